@@ -5,42 +5,78 @@
  * Copyright (C) 2017 Jeremy Soller <jeremy@system76.com>
  */
 
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/completion.h>
+#include <linux/kernel.h>
+#include <linux/leds.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/platform_device.h>
+#include <linux/version.h>
+#include <linux/workqueue.h>
+
+#include "system76.h"
+
+static const struct s76_model *s76_model;
+
+// Serializes read-modify-write cycles of the EC LED register
+static DEFINE_MUTEX(ap_led_mutex);
+
+// Writers wait for the resume restore so it does not overwrite them
+static DECLARE_COMPLETION(ap_led_restored);
+
 static enum led_brightness ap_led_brightness = 1;
 
-static bool ap_led_invert = TRUE;
+static bool ap_led_invert = true;
 
 static enum led_brightness ap_led_get(struct led_classdev *led_cdev)
 {
-	return ap_led_brightness;
+	return READ_ONCE(ap_led_brightness);
 }
 
-static int ap_led_set(struct led_classdev *led_cdev, enum led_brightness value)
+static int __ap_led_set(enum led_brightness value)
 {
 	u8 byte;
+	int err;
 
-	ec_read(0xD9, &byte);
+	lockdep_assert_held(&ap_led_mutex);
 
-	if (value > 0) {
-		ap_led_brightness = 1;
+	err = s76_ec_read(s76_model->ap_led, &byte);
+	if (err)
+		return err;
 
-		if (ap_led_invert)
-			byte &= ~BIT(6);
-		else
-			byte |= BIT(6);
-	} else {
-		ap_led_brightness = 0;
+	if ((value > 0) == ap_led_invert)
+		byte &= ~BIT(6);
+	else
+		byte |= BIT(6);
 
-		if (ap_led_invert)
-			byte |= BIT(6);
-		else
-			byte &= ~BIT(6);
-	}
+	err = s76_ec_write(s76_model->ap_led, byte);
+	if (err)
+		return err;
 
-	ec_write(0xD9, byte);
+	WRITE_ONCE(ap_led_brightness, value > 0 ? 1 : 0);
 
 	return 0;
 }
 
+static void ap_led_lock(void)
+{
+	wait_for_completion(&ap_led_restored);
+	mutex_lock(&ap_led_mutex);
+}
+
+static int ap_led_set(struct led_classdev *led_cdev, enum led_brightness value)
+{
+	int err;
+
+	ap_led_lock();
+	err = __ap_led_set(value);
+	mutex_unlock(&ap_led_mutex);
+
+	return err;
+}
+
 static struct led_classdev ap_led = {
 	.name = "system76::airplane",
 	.brightness_get = ap_led_get,
@@ -51,27 +87,25 @@ static struct led_classdev ap_led = {
 
 static ssize_t ap_led_invert_show(struct device *dev, struct device_attribute *attr, char *buf)
 {
-	return sysfs_emit(buf, "%d\n", (int)ap_led_invert);
+	return sysfs_emit(buf, "%d\n", (int)READ_ONCE(ap_led_invert));
 }
 
 static ssize_t ap_led_invert_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t size)
 {
 	unsigned int val;
 	int ret;
-	enum led_brightness brightness;
 
 	ret = kstrtouint(buf, 0, &val);
 	if (ret)
 		return ret;
 
-	brightness = ap_led_get(&ap_led);
+	ap_led_lock();
+	WRITE_ONCE(ap_led_invert, val ? true : false);
+	ret = __ap_led_set(ap_led_brightness);
+	mutex_unlock(&ap_led_mutex);
 
-	if (val)
-		ap_led_invert = TRUE;
-	else
-		ap_led_invert = FALSE;
-
-	ap_led_set(&ap_led, brightness);
+	if (ret)
+		return ret;
 
 	return size;
 }
@@ -87,14 +121,35 @@ static struct device_attribute ap_led_invert_dev_attr = {
 
 static void ap_led_resume(void)
 {
-	ap_led_set(&ap_led, ap_led_brightness);
+	mutex_lock(&ap_led_mutex);
+	__ap_led_set(ap_led_brightness);
+	mutex_unlock(&ap_led_mutex);
+}
+
+static void ap_led_restore_work_fn(struct work_struct *work)
+{
+	ktime_t start;
+
+	s76_wait_ready();
+
+	start = ktime_get();
+	ap_led_resume();
+	s76_stage("ap_led", start);
+	complete_all(&ap_led_restored);
 }
 
-static int __init ap_led_init(struct device *dev)
+static DECLARE_WORK(ap_led_restore_work, ap_led_restore_work_fn);
+
+static int ap_led_probe(struct platform_device *pdev)
 {
+	ktime_t start = ktime_get();
 	int err;
 
-	err = devm_led_classdev_register(dev, &ap_led);
+	s76_model = s76_dev_model(&pdev->dev);
+	if (!s76_model)
+		return -ENODEV;
+
+	err = devm_led_classdev_register(&pdev->dev, &ap_led);
 	if (err < 0)
 		return err;
 
@@ -102,12 +157,78 @@ static int __init ap_led_init(struct device *dev)
 	if (err < 0)
 		pr_warn("failed to create ap_led_invert\n");
 
-	ap_led_resume();
+	s76_stage("ap_led_register", start);
+
+	// The initial restore waits for the core to enable the firmware
+	reinit_completion(&ap_led_restored);
+	queue_work(system_unbound_wq, &ap_led_restore_work);
 
 	return 0;
 }
 
-static void __exit ap_led_exit(void)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 11, 0)
+static void ap_led_remove(struct platform_device *pdev)
+#else
+static int ap_led_remove(struct platform_device *pdev)
+#endif
 {
+	cancel_work_sync(&ap_led_restore_work);
+	complete_all(&ap_led_restored);
+
 	device_remove_file(ap_led.dev, &ap_led_invert_dev_attr);
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 11, 0)
+	return 0;
+#endif
+}
+
+static int ap_led_pm_suspend(struct device *dev)
+{
+	pr_debug("suspend\n");
+
+	flush_work(&ap_led_restore_work);
+	reinit_completion(&ap_led_restored);
+
+	return 0;
+}
+
+static int ap_led_pm_resume(struct device *dev)
+{
+	pr_debug("resume\n");
+
+	queue_work(system_unbound_wq, &ap_led_restore_work);
+
+	return 0;
 }
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 17, 0)
+static DEFINE_SIMPLE_DEV_PM_OPS(ap_led_pm, ap_led_pm_suspend, ap_led_pm_resume);
+#else
+static SIMPLE_DEV_PM_OPS(ap_led_pm, ap_led_pm_suspend, ap_led_pm_resume);
+#endif
+
+static const struct platform_device_id ap_led_ids[] = {
+	{ S76_AP_LED_NAME, 0 },
+	{ },
+};
+MODULE_DEVICE_TABLE(platform, ap_led_ids);
+
+static struct platform_driver ap_led_driver = {
+	.probe = ap_led_probe,
+	.remove = ap_led_remove,
+	.id_table = ap_led_ids,
+	.driver = {
+		.name = S76_AP_LED_NAME,
+		.probe_type = PROBE_PREFER_ASYNCHRONOUS,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 17, 0)
+		.pm = pm_sleep_ptr(&ap_led_pm),
+#else
+		.pm = pm_ptr(&ap_led_pm),
+#endif
+	},
+};
+module_platform_driver(ap_led_driver);
+
+MODULE_AUTHOR("Jeremy Soller <jeremy@system76.com>");
+MODULE_DESCRIPTION("System76 airplane mode LED driver");
+MODULE_LICENSE("GPL");
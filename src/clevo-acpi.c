@@ -1,17 +1,25 @@
 // SPDX-License-Identifier: GPL-2.0-or-later
 
 #define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+#define S76_ZONES_DEFINE
 
 #include <linux/acpi.h>
+#include <linux/debugfs.h>
 #include <linux/dmi.h>
 #include <linux/input.h>
 #include <linux/input/sparse-keymap.h>
 #include <linux/leds.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
 #include <linux/platform_device.h>
 #include <linux/pm.h>
+#include <linux/seqlock.h>
 #include <linux/version.h>
 
+#include "latency.h"
+#include "timeline.h"
+#include "zones.h"
+
 // Clevo DCHU DSM UUID: "93f224e4-fbdc-4bbf-add6-db71bdc0afad"
 static const guid_t dchu_dsm_guid =
 	GUID_INIT(0x93f224e4, 0xfbdc, 0x4bbf,
@@ -40,12 +48,41 @@ struct clevo_data {
 	struct platform_device *pdev;
 	struct input_dev *input;
 	struct led_classdev kb_led;
+	// Serializes KBLED firmware writes; `kb_seq` publishes `kb_brightness`
+	struct mutex kb_lock;
+	seqcount_mutex_t kb_seq;
 	u8 kb_brightness;
 	u8 kb_toggle_brightness;
 	u32 kb_color_index;
 	u8 kbd_type;
+	struct dentry *debugfs;
+	struct s76_timelines timelines;
+	struct s76_latency latency;
 };
 
+static void clevo_stage(struct clevo_data *priv, const char *name, ktime_t start)
+{
+	s76_timeline_add(&priv->timelines, name, start);
+}
+
+static int clevo_latency_show(struct seq_file *m, void *unused)
+{
+	struct clevo_data *priv = m->private;
+
+	s76_latency_show(m, &priv->latency);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(clevo_latency);
+
+static int clevo_timelines_show(struct seq_file *m, void *unused)
+{
+	struct clevo_data *priv = m->private;
+
+	s76_timeline_show(m, &priv->timelines);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(clevo_timelines);
+
 static const struct key_entry clevo_keymap[] = {
 	// White-only KBD
 	{ KE_KEY, 0x20, { KEY_KBDILLUMDOWN } },
@@ -132,13 +169,6 @@ static acpi_status clevo_ec_cmd(u8 *input, size_t input_length,
 static void clevo_ec_kbd_color_set(u32 color)
 {
 	u8 buf[8] = {};
-	const u8 zones[] = {
-		0x03, // Left
-		0x04, // Middle
-		0x05, // Right
-		0x0B, // Numpad
-		0x07, // Lightbar
-	};
 
 	buf[0] = 5; // Payload size
 	buf[2] = 0xCA; // Command
@@ -146,8 +176,8 @@ static void clevo_ec_kbd_color_set(u32 color)
 	buf[5] = (color >> 16) & 0xFF; // Red
 	buf[6] = (color >> 8) & 0xFF; // Green
 
-	for (int i = 0;  i < ARRAY_SIZE(zones); i++) {
-		buf[3] = zones[i];
+	for (int i = 0;  i < ARRAY_SIZE(s76_zones_ecmd); i++) {
+		buf[3] = s76_zones_ecmd[i].ecmd;
 		(void)clevo_ec_cmd(buf, ARRAY_SIZE(buf), NULL, 0);
 	}
 }
@@ -225,100 +255,140 @@ static bool clevo_enable_notify_events(acpi_handle handle)
 static enum led_brightness clevo_kbled_get(struct led_classdev *led_cdev)
 {
 	struct clevo_data *priv;
+	unsigned int seq;
+	u8 value;
 
 	priv = container_of(led_cdev, struct clevo_data, kb_led);
 
-	return priv->kb_brightness;
+	do {
+		seq = read_seqcount_begin(&priv->kb_seq);
+		value = priv->kb_brightness;
+	} while (read_seqcount_retry(&priv->kb_seq, seq));
+
+	return value;
 }
 
-static int clevo_kbled_set(struct led_classdev *led_cdev,
-			   enum led_brightness brightness)
+static void __clevo_kbled_set(struct clevo_data *priv,
+			      enum led_brightness brightness)
 {
-	struct clevo_data *priv;
-	struct acpi_device *adev;
+	struct acpi_device *adev = ACPI_COMPANION(&priv->pdev->dev);
 
-	pr_debug("%s %d\n", __func__, (int)brightness);
+	lockdep_assert_held(&priv->kb_lock);
 
-	priv = container_of(led_cdev, struct clevo_data, kb_led);
-	adev = ACPI_COMPANION(&priv->pdev->dev);
+	pr_debug("%s %d\n", __func__, (int)brightness);
 
+	write_seqcount_begin(&priv->kb_seq);
 	priv->kb_brightness = brightness;
+	write_seqcount_end(&priv->kb_seq);
 
 	if (priv->kbd_type == 1)
-		clevo_dchu_cmd(adev->handle, 0x27, priv->kb_brightness);
+		clevo_dchu_cmd(adev->handle, 0x27, brightness);
 	else
-		clevo_ec_kbd_brightness_set(priv->kb_brightness);
+		clevo_ec_kbd_brightness_set(brightness);
+}
+
+static int clevo_kbled_set(struct led_classdev *led_cdev,
+			   enum led_brightness brightness)
+{
+	struct clevo_data *priv;
+
+	priv = container_of(led_cdev, struct clevo_data, kb_led);
+
+	mutex_lock(&priv->kb_lock);
+	__clevo_kbled_set(priv, brightness);
+	mutex_unlock(&priv->kb_lock);
 
 	return 0;
 }
 
 static void kbled_hotkey_toggle(struct clevo_data *priv)
 {
+	mutex_lock(&priv->kb_lock);
+
 	if (priv->kb_brightness > 0) {
 		priv->kb_toggle_brightness = priv->kb_brightness;
-		priv->kb_brightness = 0;
+		__clevo_kbled_set(priv, 0);
 	} else {
-		priv->kb_brightness = priv->kb_toggle_brightness;
+		__clevo_kbled_set(priv, priv->kb_toggle_brightness);
 	}
 
-	clevo_kbled_set(&priv->kb_led, priv->kb_brightness);
 	led_classdev_notify_brightness_hw_changed(&priv->kb_led, priv->kb_brightness);
+
+	mutex_unlock(&priv->kb_lock);
 }
 
 static void kbled_hotkey_white_dec(struct clevo_data *priv)
 {
+	mutex_lock(&priv->kb_lock);
+
 	if (priv->kb_brightness > 0)
-		priv->kb_brightness--;
+		__clevo_kbled_set(priv, priv->kb_brightness - 1);
+	else
+		__clevo_kbled_set(priv, priv->kb_brightness);
 
-	clevo_kbled_set(&priv->kb_led, priv->kb_brightness);
 	led_classdev_notify_brightness_hw_changed(&priv->kb_led, priv->kb_brightness);
+
+	mutex_unlock(&priv->kb_lock);
 }
 
 static void kbled_hotkey_rgb_dec(struct clevo_data *priv)
 {
+	mutex_lock(&priv->kb_lock);
+
 	if (priv->kb_brightness > 0) {
 		for (int i = ARRAY_SIZE(kb_led_levels); i > 0; i--) {
 			if (kb_led_levels[i - 1] < priv->kb_brightness) {
-				priv->kb_brightness = kb_led_levels[i - 1];
-				clevo_kbled_set(&priv->kb_led, priv->kb_brightness);
+				__clevo_kbled_set(priv, kb_led_levels[i - 1]);
 				break;
 			}
 		}
 	} else {
-		clevo_kbled_set(&priv->kb_led, priv->kb_toggle_brightness);
+		__clevo_kbled_set(priv, priv->kb_toggle_brightness);
 	}
 
 	led_classdev_notify_brightness_hw_changed(&priv->kb_led, priv->kb_brightness);
+
+	mutex_unlock(&priv->kb_lock);
 }
 
 static void kbled_hotkey_white_inc(struct clevo_data *priv)
 {
+	mutex_lock(&priv->kb_lock);
+
 	if (priv->kb_brightness < 5)
-		priv->kb_brightness++;
+		__clevo_kbled_set(priv, priv->kb_brightness + 1);
+	else
+		__clevo_kbled_set(priv, priv->kb_brightness);
 
-	clevo_kbled_set(&priv->kb_led, priv->kb_brightness);
 	led_classdev_notify_brightness_hw_changed(&priv->kb_led, priv->kb_brightness);
+
+	mutex_unlock(&priv->kb_lock);
 }
 
 static void kbled_hotkey_rgb_inc(struct clevo_data *priv)
 {
+	mutex_lock(&priv->kb_lock);
+
 	if (priv->kb_brightness > 0) {
 		for (int i = 0; i < ARRAY_SIZE(kb_led_levels); i++) {
 			if (kb_led_levels[i] > priv->kb_brightness) {
-				priv->kb_brightness = kb_led_levels[i];
-				clevo_kbled_set(&priv->kb_led, priv->kb_brightness);
+				__clevo_kbled_set(priv, kb_led_levels[i]);
 				break;
 			}
 		}
 	} else {
-		clevo_kbled_set(&priv->kb_led, priv->kb_toggle_brightness);
+		__clevo_kbled_set(priv, priv->kb_toggle_brightness);
 	}
 
 	led_classdev_notify_brightness_hw_changed(&priv->kb_led, priv->kb_brightness);
+
+	mutex_unlock(&priv->kb_lock);
 }
 
 static void kbled_hotkey_rgb_color(struct clevo_data *priv)
 {
+	mutex_lock(&priv->kb_lock);
+
 	priv->kb_color_index += 1;
 	if (priv->kb_color_index >= ARRAY_SIZE(kb_led_colors))
 		priv->kb_color_index = 0;
@@ -326,6 +396,8 @@ static void kbled_hotkey_rgb_color(struct clevo_data *priv)
 	clevo_ec_kbd_color_set(kb_led_colors[priv->kb_color_index]);
 
 	led_classdev_notify_brightness_hw_changed(&priv->kb_led, priv->kb_brightness);
+
+	mutex_unlock(&priv->kb_lock);
 }
 
 static int clevo_kbled_init(struct device *dev)
@@ -337,9 +409,11 @@ static int clevo_kbled_init(struct device *dev)
 		.default_label = ":" LED_FUNCTION_KBD_BACKLIGHT,
 		.devname_mandatory = true,
 	};
+	ktime_t start = ktime_get();
 	int err;
 
 	priv->kbd_type = clevo_dchu_kbd_type(adev->handle);
+	clevo_stage(priv, "kb_type", start);
 
 	if (priv->kbd_type == 1) {
 		pr_debug("white-only KBLED\n");
@@ -361,14 +435,20 @@ static int clevo_kbled_init(struct device *dev)
 	priv->kb_led.flags = LED_BRIGHT_HW_CHANGED |
 			     LED_REJECT_NAME_CONFLICT;
 
+	start = ktime_get();
 	err = devm_led_classdev_register_ext(dev, &priv->kb_led, &init_data);
 	if (err)
 		return err;
+	clevo_stage(priv, "kb_led_register", start);
 
+	start = ktime_get();
+	mutex_lock(&priv->kb_lock);
 	clevo_dchu_cmd(adev->handle, 0x67, 0xE007F001);
-	clevo_kbled_set(&priv->kb_led, priv->kb_brightness);
+	__clevo_kbled_set(priv, priv->kb_brightness);
 	if (priv->kbd_type != 1)
 		clevo_ec_kbd_color_set(kb_led_colors[priv->kb_color_index]);
+	mutex_unlock(&priv->kb_lock);
+	clevo_stage(priv, "kb_restore", start);
 
 	return 0;
 }
@@ -407,6 +487,8 @@ static int clevo_input_init(struct device *dev)
 static void clevo_acpi_notify(acpi_handle handle, u32 event, void *context)
 {
 	struct clevo_data *priv = dev_get_drvdata(context);
+	ktime_t stamp = ktime_get();
+	bool led = true;
 
 	pr_debug("event: %#x\n", event);
 
@@ -427,15 +509,25 @@ static void clevo_acpi_notify(acpi_handle handle, u32 event, void *context)
 	case 0x83:
 		if (priv->kbd_type != 1)
 			kbled_hotkey_rgb_color(priv);
+		else
+			led = false;
 		break;
 
 	case 0x3f:
 	case 0x9f:
 		kbled_hotkey_toggle(priv);
 		break;
+
+	default:
+		led = false;
 	}
 
-	if (!sparse_keymap_report_event(priv->input, event, 1, true))
+	if (led)
+		s76_latency_add(&priv->latency, event, S76_LATENCY_LED, stamp);
+
+	if (sparse_keymap_report_event(priv->input, event, 1, true))
+		s76_latency_add(&priv->latency, event, S76_LATENCY_INPUT, stamp);
+	else
 		pr_warn("unknown key event: %#x\n", event);
 }
 
@@ -450,14 +542,23 @@ static int clevo_acpi_resume(struct device *dev)
 {
 	struct clevo_data *priv = dev_get_drvdata(dev);
 	struct acpi_device *adev = ACPI_COMPANION(dev);
+	ktime_t start;
 
 	dev_dbg(dev, "resume\n");
 
+	s76_timeline_begin(&priv->timelines, "resume");
+
+	start = ktime_get();
 	clevo_enable_notify_events(adev->handle);
+	clevo_stage(priv, "notify_enable", start);
 
 	// FIXME: This fixes turning KBLED back on for some reason.
 	// Even on White-only KBLED.
+	start = ktime_get();
+	mutex_lock(&priv->kb_lock);
 	clevo_ec_kbd_color_set(kb_led_colors[priv->kb_color_index]);
+	mutex_unlock(&priv->kb_lock);
+	clevo_stage(priv, "kb_restore", start);
 
 	return 0;
 }
@@ -493,6 +594,8 @@ static int clevo_acpi_probe(struct platform_device *pdev)
 {
 	struct clevo_data *priv;
 	struct acpi_device *adev;
+	char name[48];
+	ktime_t start;
 	int err;
 
 	dev_dbg(&pdev->dev, "probe\n");
@@ -512,30 +615,54 @@ static int clevo_acpi_probe(struct platform_device *pdev)
 
 	platform_set_drvdata(pdev, priv);
 	priv->pdev = pdev;
+	mutex_init(&priv->kb_lock);
+	seqcount_mutex_init(&priv->kb_seq, &priv->kb_lock);
+	spin_lock_init(&priv->timelines.lock);
+	spin_lock_init(&priv->latency.lock);
+
+	s76_timeline_begin(&priv->timelines, "probe");
 
+	start = ktime_get();
 	err = clevo_input_init(&pdev->dev);
 	if (err)
 		return err;
+	clevo_stage(priv, "input_init", start);
 
 	err = clevo_kbled_init(&pdev->dev);
 	if (err)
 		return err;
 
 	// TODO: Use `devm_acpi_install_notify_handler` when available.
+	start = ktime_get();
 	err = acpi_dev_install_notify_handler(adev, ACPI_ALL_NOTIFY,
 					      clevo_acpi_notify, &pdev->dev);
 	if (err)
 		return err;
+	clevo_stage(priv, "notify_handler", start);
 
+	start = ktime_get();
 	clevo_enable_notify_events(adev->handle);
+	clevo_stage(priv, "notify_enable", start);
+
+	// One directory per device, named like clevo-acpi-CLV0001:00
+	snprintf(name, sizeof(name), "clevo-acpi-%s", dev_name(&pdev->dev));
+	priv->debugfs = debugfs_create_dir(name, NULL);
+	debugfs_create_file("timelines", 0444, priv->debugfs, priv,
+			    &clevo_timelines_fops);
+	debugfs_create_file("latency", 0444, priv->debugfs, priv,
+			    &clevo_latency_fops);
 
 	return 0;
 }
 
 static void clevo_acpi_remove(struct platform_device *pdev)
 {
+	struct clevo_data *priv = platform_get_drvdata(pdev);
+
 	dev_dbg(&pdev->dev, "remove\n");
 
+	debugfs_remove_recursive(priv->debugfs);
+
 	acpi_dev_remove_notify_handler(ACPI_COMPANION(&pdev->dev),
 				       ACPI_ALL_NOTIFY, clevo_acpi_notify);
 }
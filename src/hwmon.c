@@ -7,9 +7,25 @@
  * Copyright (C) 2013-2015 TUXEDO Computers GmbH <tux@tuxedocomputers.com>
  */
 
-#define EXPERIMENTAL
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
 
-#if IS_ENABLED(CONFIG_HWMON)
+#include <linux/hwmon.h>
+#include <linux/hwmon-sysfs.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/platform_device.h>
+#include <linux/reboot.h>
+#include <linux/seqlock.h>
+#include <linux/version.h>
+
+#include "system76.h"
+
+// Attributes are declared for at most this many fans and sensors
+#define S76_HWMON_FANS	2
+#define S76_HWMON_TEMPS	2
+
+static const struct s76_model *s76_model;
 
 struct s76_hwmon {
 	struct device *dev;
@@ -21,10 +37,15 @@ static int s76_read_fan(int idx)
 {
 	u8 value;
 	int raw_rpm;
+	int err;
 
-	ec_read(0xd0 + 0x2 * idx, &value);
+	err = s76_ec_read(s76_model->fans[idx].rpm, &value);
+	if (err)
+		return err;
 	raw_rpm = value << 8;
-	ec_read(0xd1 + 0x2 * idx, &value);
+	err = s76_ec_read(s76_model->fans[idx].rpm + 1, &value);
+	if (err)
+		return err;
 	raw_rpm += value;
 	if (!raw_rpm)
 		return 0;
@@ -34,8 +55,11 @@ static int s76_read_fan(int idx)
 static int s76_read_pwm(int idx)
 {
 	u8 value;
+	int err;
 
-	ec_read(0xce + idx, &value);
+	err = s76_ec_read(s76_model->fans[idx].duty, &value);
+	if (err)
+		return err;
 	return value;
 }
 
@@ -43,14 +67,14 @@ static int s76_write_pwm(int idx, u8 duty)
 {
 	u8 values[] = {idx + 1, duty};
 
-	return ec_transaction(0x99, values, sizeof(values), NULL, 0);
+	return s76_ec_transaction(0x99, values, sizeof(values), NULL, 0);
 }
 
 static int s76_write_pwm_auto(int idx)
 {
 	u8 values[] = {0xff, idx + 1};
 
-	return ec_transaction(0x99, values, sizeof(values), NULL, 0);
+	return s76_ec_transaction(0x99, values, sizeof(values), NULL, 0);
 }
 
 static ssize_t s76_hwmon_show_fan_input(struct device *dev,
@@ -58,32 +82,54 @@ static ssize_t s76_hwmon_show_fan_input(struct device *dev,
 					char *buf)
 {
 	int index = to_sensor_dev_attr(attr)->index;
+	int rpm;
 
-	return sysfs_emit(buf, "%i\n", s76_read_fan(index));
+	rpm = s76_read_fan(index);
+	if (rpm < 0)
+		return rpm;
+	return sysfs_emit(buf, "%i\n", rpm);
 }
 
 static ssize_t s76_hwmon_show_fan_label(struct device *dev,
 					struct device_attribute *attr,
 					char *buf)
 {
-	switch (to_sensor_dev_attr(attr)->index) {
-	case 0:
-		return sysfs_emit(buf, "CPU fan\n");
-	case 1:
-		return sysfs_emit(buf, "GPU fan\n");
-	}
-	return 0;
+	int index = to_sensor_dev_attr(attr)->index;
+
+	return sysfs_emit(buf, "%s\n", s76_model->fans[index].label);
 }
 
-static int pwm_enabled[] = {2, 2};
+/*
+ * Fan mode writes are serialized by s76_pwm_mutex; readers take a lockless
+ * snapshot through s76_pwm_seq.
+ */
+static DEFINE_MUTEX(s76_pwm_mutex);
+static seqcount_mutex_t s76_pwm_seq = SEQCNT_MUTEX_ZERO(s76_pwm_seq, &s76_pwm_mutex);
+
+static int pwm_enabled[S76_HWMON_FANS] = {2, 2};
+// Last duty written in manual mode, protected by s76_pwm_mutex
+static u8 pwm_duty[S76_HWMON_FANS];
+
+static void s76_pwm_enabled_update(int index, int value)
+{
+	lockdep_assert_held(&s76_pwm_mutex);
+
+	write_seqcount_begin(&s76_pwm_seq);
+	pwm_enabled[index] = value;
+	write_seqcount_end(&s76_pwm_seq);
+}
 
 static ssize_t s76_hwmon_show_pwm(struct device *dev,
 				  struct device_attribute *attr,
 				  char *buf)
 {
 	int index = to_sensor_dev_attr(attr)->index;
+	int pwm;
 
-	return sysfs_emit(buf, "%i\n", s76_read_pwm(index));
+	pwm = s76_read_pwm(index);
+	if (pwm < 0)
+		return pwm;
+	return sysfs_emit(buf, "%i\n", pwm);
 }
 
 static ssize_t s76_hwmon_set_pwm(struct device *dev,
@@ -99,11 +145,16 @@ static ssize_t s76_hwmon_set_pwm(struct device *dev,
 		return err;
 	if (value > 255)
 		return -EINVAL;
+
+	mutex_lock(&s76_pwm_mutex);
 	err = s76_write_pwm(index, value);
-	if (err)
-		return err;
-	pwm_enabled[index] = 1;
-	return count;
+	if (!err) {
+		s76_pwm_enabled_update(index, 1);
+		pwm_duty[index] = value;
+	}
+	mutex_unlock(&s76_pwm_mutex);
+
+	return err ? err : count;
 }
 
 static ssize_t s76_hwmon_show_pwm_enable(struct device *dev,
@@ -111,8 +162,15 @@ static ssize_t s76_hwmon_show_pwm_enable(struct device *dev,
 					 char *buf)
 {
 	int index = to_sensor_dev_attr(attr)->index;
+	unsigned int seq;
+	int value;
+
+	do {
+		seq = read_seqcount_begin(&s76_pwm_seq);
+		value = pwm_enabled[index];
+	} while (read_seqcount_retry(&s76_pwm_seq, seq));
 
-	return sysfs_emit(buf, "%i\n", pwm_enabled[index]);
+	return sysfs_emit(buf, "%i\n", value);
 }
 
 static ssize_t s76_hwmon_set_pwm_enable(struct device *dev,
@@ -126,115 +184,134 @@ static ssize_t s76_hwmon_set_pwm_enable(struct device *dev,
 	err = kstrtou32(buf, 10, &value);
 	if (err)
 		return err;
-	if (value == 0) {
+	if (value > 2)
+		return -EINVAL;
+
+	mutex_lock(&s76_pwm_mutex);
+	if (value == 0)
 		err = s76_write_pwm(index, 255);
-		if (err)
-			return err;
-		pwm_enabled[index] = value;
-		return count;
-	}
-	if (value == 1) {
+	else if (value == 1)
 		err = s76_write_pwm(index, 0);
-		if (err)
-			return err;
-		pwm_enabled[index] = value;
-		return count;
-	}
-	if (value == 2) {
+	else
 		err = s76_write_pwm_auto(index);
-		if (err)
-			return err;
-		pwm_enabled[index] = value;
-		return count;
+	if (!err) {
+		s76_pwm_enabled_update(index, value);
+		pwm_duty[index] = value ? 0 : 255;
 	}
-	return -EINVAL;
-}
-
-static ssize_t s76_hwmon_show_temp1_input(struct device *dev,
-					  struct device_attribute *attr,
-					  char *buf)
-{
-	u8 value;
+	mutex_unlock(&s76_pwm_mutex);
 
-	ec_read(0x07, &value);
-	return sysfs_emit(buf, "%i\n", value * 1000);
-}
-
-static ssize_t s76_hwmon_show_temp1_label(struct device *dev,
-					  struct device_attribute *attr,
-					  char *buf)
-{
-	return sysfs_emit(buf, "CPU temperature\n");
+	return err ? err : count;
 }
 
-#ifdef EXPERIMENTAL
-static ssize_t s76_hwmon_show_temp2_input(struct device *dev,
-					  struct device_attribute *attr,
-					  char *buf)
+static ssize_t s76_hwmon_show_temp_input(struct device *dev,
+					 struct device_attribute *attr,
+					 char *buf)
 {
+	int index = to_sensor_dev_attr(attr)->index;
 	u8 value;
+	int err;
 
-	ec_read(0xcd, &value);
+	err = s76_ec_read(s76_model->temps[index].reg, &value);
+	if (err)
+		return err;
 	return sysfs_emit(buf, "%i\n", value * 1000);
 }
 
-static ssize_t s76_hwmon_show_temp2_label(struct device *dev,
-					  struct device_attribute *attr,
-					  char *buf)
+static ssize_t s76_hwmon_show_temp_label(struct device *dev,
+					 struct device_attribute *attr,
+					 char *buf)
 {
-	return sysfs_emit(buf, "GPU temperature\n");
+	int index = to_sensor_dev_attr(attr)->index;
+
+	return sysfs_emit(buf, "%s\n", s76_model->temps[index].label);
 }
-#endif
 
 static SENSOR_DEVICE_ATTR(fan1_input, 0444, s76_hwmon_show_fan_input, NULL, 0);
 static SENSOR_DEVICE_ATTR(fan1_label, 0444, s76_hwmon_show_fan_label, NULL, 0);
 static SENSOR_DEVICE_ATTR(pwm1, 0644, s76_hwmon_show_pwm, s76_hwmon_set_pwm, 0);
 static SENSOR_DEVICE_ATTR(pwm1_enable, 0644, s76_hwmon_show_pwm_enable, s76_hwmon_set_pwm_enable, 0);
-#ifdef EXPERIMENTAL
 static SENSOR_DEVICE_ATTR(fan2_input, 0444, s76_hwmon_show_fan_input, NULL, 1);
 static SENSOR_DEVICE_ATTR(fan2_label, 0444, s76_hwmon_show_fan_label, NULL, 1);
 static SENSOR_DEVICE_ATTR(pwm2, 0644, s76_hwmon_show_pwm, s76_hwmon_set_pwm, 1);
 static SENSOR_DEVICE_ATTR(pwm2_enable, 0644, s76_hwmon_show_pwm_enable, s76_hwmon_set_pwm_enable, 1);
-#endif
-static SENSOR_DEVICE_ATTR(temp1_input, 0444, s76_hwmon_show_temp1_input, NULL, 0);
-static SENSOR_DEVICE_ATTR(temp1_label, 0444, s76_hwmon_show_temp1_label, NULL, 0);
-#ifdef EXPERIMENTAL
-static SENSOR_DEVICE_ATTR(temp2_input, 0444, s76_hwmon_show_temp2_input, NULL, 1);
-static SENSOR_DEVICE_ATTR(temp2_label, 0444, s76_hwmon_show_temp2_label, NULL, 1);
-#endif
+static SENSOR_DEVICE_ATTR(temp1_input, 0444, s76_hwmon_show_temp_input, NULL, 0);
+static SENSOR_DEVICE_ATTR(temp1_label, 0444, s76_hwmon_show_temp_label, NULL, 0);
+static SENSOR_DEVICE_ATTR(temp2_input, 0444, s76_hwmon_show_temp_input, NULL, 1);
+static SENSOR_DEVICE_ATTR(temp2_label, 0444, s76_hwmon_show_temp_label, NULL, 1);
 
-static struct attribute *hwmon_default_attributes[] = {
+static struct attribute *hwmon_fan_attributes[] = {
 	&sensor_dev_attr_fan1_input.dev_attr.attr,
 	&sensor_dev_attr_fan1_label.dev_attr.attr,
 	&sensor_dev_attr_pwm1.dev_attr.attr,
 	&sensor_dev_attr_pwm1_enable.dev_attr.attr,
-#ifdef EXPERIMENTAL
 	&sensor_dev_attr_fan2_input.dev_attr.attr,
 	&sensor_dev_attr_fan2_label.dev_attr.attr,
 	&sensor_dev_attr_pwm2.dev_attr.attr,
 	&sensor_dev_attr_pwm2_enable.dev_attr.attr,
-#endif
+	NULL
+};
+
+static struct attribute *hwmon_temp_attributes[] = {
 	&sensor_dev_attr_temp1_input.dev_attr.attr,
 	&sensor_dev_attr_temp1_label.dev_attr.attr,
-#ifdef EXPERIMENTAL
 	&sensor_dev_attr_temp2_input.dev_attr.attr,
 	&sensor_dev_attr_temp2_label.dev_attr.attr,
-#endif
 	NULL
 };
 
-static const struct attribute_group hwmon_default_group = {
-	.attrs = hwmon_default_attributes,
+static int s76_hwmon_attr_index(struct attribute *attr)
+{
+	struct device_attribute *dev_attr;
+
+	dev_attr = container_of(attr, struct device_attribute, attr);
+	return to_sensor_dev_attr(dev_attr)->index;
+}
+
+static umode_t s76_hwmon_fan_visible(struct kobject *kobj,
+				     struct attribute *attr, int n)
+{
+	if (s76_hwmon_attr_index(attr) >= s76_model->nr_fans)
+		return 0;
+	return attr->mode;
+}
+
+static umode_t s76_hwmon_temp_visible(struct kobject *kobj,
+				      struct attribute *attr, int n)
+{
+	if (s76_hwmon_attr_index(attr) >= s76_model->nr_temps)
+		return 0;
+	return attr->mode;
+}
+
+static const struct attribute_group hwmon_fan_group = {
+	.attrs = hwmon_fan_attributes,
+	.is_visible = s76_hwmon_fan_visible,
+};
+
+static const struct attribute_group hwmon_temp_group = {
+	.attrs = hwmon_temp_attributes,
+	.is_visible = s76_hwmon_temp_visible,
 };
-__ATTRIBUTE_GROUPS(hwmon_default);
+
+static const struct attribute_group *hwmon_default_groups[] = {
+	&hwmon_fan_group,
+	&hwmon_temp_group,
+	NULL
+};
+
+// Number of fans the driver controls
+static int s76_hwmon_fans(void)
+{
+	return min_t(int, s76_model->nr_fans, S76_HWMON_FANS);
+}
 
 static int s76_hwmon_reboot_callback(struct notifier_block *nb,
 				     unsigned long action, void *data)
 {
-	s76_write_pwm_auto(0);
-#ifdef EXPERIMENTAL
-	s76_write_pwm_auto(1);
-#endif
+	int i;
+
+	for (i = 0; i < s76_hwmon_fans(); i++)
+		s76_write_pwm_auto(i);
 	return NOTIFY_DONE;
 }
 
@@ -242,34 +319,141 @@ static struct notifier_block s76_hwmon_reboot_notifier = {
 	.notifier_call = s76_hwmon_reboot_callback
 };
 
+static_assert(S76_HWMON_FANS <= S76_PROFILE_FANS_MAX);
+
+// Apply the fan settings of a profile, fans already set are skipped
+static int s76_hwmon_profile(struct notifier_block *nb, unsigned long action,
+			     void *data)
+{
+	struct s76_profile_ctx *ctx = data;
+	const struct s76_profile *profile = ctx->profile;
+	int err = 0;
+	u8 duty;
+	int i;
+
+	if (!(profile->set & S76_PROFILE_FANS))
+		return NOTIFY_DONE;
+
+	ctx->handled |= S76_PROFILE_FANS;
+	if (action == S76_PROFILE_CHECK)
+		return NOTIFY_OK;
+
+	mutex_lock(&s76_pwm_mutex);
+	for (i = 0; i < s76_hwmon_fans() && !err; i++) {
+		if (!profile->nr_fan_duties) {
+			if (pwm_enabled[i] == 2)
+				continue;
+
+			err = s76_write_pwm_auto(i);
+			if (!err)
+				s76_pwm_enabled_update(i, 2);
+		} else {
+			duty = profile->fan_duties[profile->nr_fan_duties == 1 ? 0 : i];
+			if (pwm_enabled[i] == 1 && pwm_duty[i] == duty)
+				continue;
+
+			err = s76_write_pwm(i, duty);
+			if (!err) {
+				s76_pwm_enabled_update(i, 1);
+				pwm_duty[i] = duty;
+			}
+		}
+	}
+	mutex_unlock(&s76_pwm_mutex);
+
+	return notifier_from_errno(err);
+}
+
+static struct notifier_block s76_hwmon_profile_notifier = {
+	.notifier_call = s76_hwmon_profile,
+	.priority = S76_PROFILE_PRIO_FANS,
+};
+
 static int s76_hwmon_init(struct device *dev)
 {
+	int i;
+
 	s76_hwmon = devm_kzalloc(dev, sizeof(*s76_hwmon), GFP_KERNEL);
 	if (!s76_hwmon)
 		return -ENOMEM;
 
-	s76_hwmon->dev = devm_hwmon_device_register_with_groups(dev, S76_DRIVER_NAME, NULL, hwmon_default_groups);
+	s76_hwmon->dev = devm_hwmon_device_register_with_groups(dev, "system76", NULL, hwmon_default_groups);
 	if (IS_ERR(s76_hwmon->dev))
 		return PTR_ERR(s76_hwmon->dev);
 
 	(void)devm_register_reboot_notifier(dev, &s76_hwmon_reboot_notifier);
-	s76_write_pwm_auto(0);
-#ifdef EXPERIMENTAL
-	s76_write_pwm_auto(1);
-#endif
+	for (i = 0; i < s76_hwmon_fans(); i++)
+		s76_write_pwm_auto(i);
 	return 0;
 }
 
 static int s76_hwmon_fini(struct device *dev)
 {
+	int i;
+
 	if (!s76_hwmon || IS_ERR_OR_NULL(s76_hwmon->dev))
 		return 0;
 
-	s76_write_pwm_auto(0);
-#ifdef EXPERIMENTAL
-	s76_write_pwm_auto(1);
+	for (i = 0; i < s76_hwmon_fans(); i++)
+		s76_write_pwm_auto(i);
+	return 0;
+}
+
+static int s76_hwmon_probe(struct platform_device *pdev)
+{
+	ktime_t start = ktime_get();
+	int err;
+
+	s76_model = s76_dev_model(&pdev->dev);
+	if (!s76_model)
+		return -ENODEV;
+
+	err = s76_hwmon_init(&pdev->dev);
+	if (err)
+		return err;
+
+	err = s76_profile_register(&s76_hwmon_profile_notifier);
+	if (err) {
+		s76_hwmon_fini(&pdev->dev);
+		return err;
+	}
+
+	s76_stage("hwmon_init", start);
+
+	return 0;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 11, 0)
+static void s76_hwmon_remove(struct platform_device *pdev)
+#else
+static int s76_hwmon_remove(struct platform_device *pdev)
 #endif
+{
+	s76_profile_unregister(&s76_hwmon_profile_notifier);
+	s76_hwmon_fini(&pdev->dev);
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 11, 0)
 	return 0;
+#endif
 }
 
-#endif // CONFIG_HWMON
+static const struct platform_device_id s76_hwmon_ids[] = {
+	{ S76_HWMON_NAME, 0 },
+	{ },
+};
+MODULE_DEVICE_TABLE(platform, s76_hwmon_ids);
+
+static struct platform_driver s76_hwmon_driver = {
+	.probe = s76_hwmon_probe,
+	.remove = s76_hwmon_remove,
+	.id_table = s76_hwmon_ids,
+	.driver = {
+		.name = S76_HWMON_NAME,
+		.probe_type = PROBE_PREFER_ASYNCHRONOUS,
+	},
+};
+module_platform_driver(s76_hwmon_driver);
+
+MODULE_AUTHOR("Jeremy Soller <jeremy@system76.com>");
+MODULE_DESCRIPTION("System76 fan and temperature driver");
+MODULE_LICENSE("GPL");
@@ -7,25 +7,44 @@
  * Copyright (C) 2013-2015 TUXEDO Computers GmbH <tux@tuxedocomputers.com>
  */
 
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/atomic.h>
+#include <linux/input.h>
+#include <linux/jiffies.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/platform_device.h>
+#include <linux/version.h>
+#include <linux/workqueue.h>
+
+#include "system76.h"
+
+static const struct s76_model *s76_model;
+
 static struct input_dev *s76_input_device;
-static DEFINE_MUTEX(s76_input_report_mutex);
 
 #define POLL_FREQ_MIN     1
 #define POLL_FREQ_MAX     20
 #define POLL_FREQ_DEFAULT 5
 
+// Poll at poll_freq for this long after a key press, then back off
+#define POLL_ACTIVE_MS    5000
+
 static int param_set_poll_freq(const char *val, const struct kernel_param *kp)
 {
+	u8 freq;
 	int ret;
 
-	ret = param_set_byte(val, kp);
+	ret = kstrtou8(val, 0, &freq);
+	if (ret)
+		return ret;
 
-	if (!ret)
-		*((unsigned char *)kp->arg) = clamp_t(unsigned char,
-			*((unsigned char *)kp->arg),
-			POLL_FREQ_MIN, POLL_FREQ_MAX);
+	// The poller divides by it, never store the unclamped value
+	WRITE_ONCE(*((unsigned char *)kp->arg),
+		   clamp_t(unsigned char, freq, POLL_FREQ_MIN, POLL_FREQ_MAX));
 
-	return ret;
+	return 0;
 }
 
 static const struct kernel_param_ops param_ops_poll_freq = {
@@ -35,98 +54,218 @@ static const struct kernel_param_ops param_ops_poll_freq = {
 
 static unsigned char param_poll_freq = POLL_FREQ_DEFAULT;
 #define param_check_poll_freq param_check_byte
-module_param_named(poll_freq, param_poll_freq, poll_freq, 0400);
-MODULE_PARM_DESC(poll_freq, "Set polling frequency");
+module_param_named(poll_freq, param_poll_freq, poll_freq, 0644);
+MODULE_PARM_DESC(poll_freq, "Set polling frequency after a key press");
+
+/*
+ * Key presses go through a bounded lock-free ring. Any context may push
+ * without sleeping, and s76_input_report_work is the only consumer. Each slot
+ * has a sequence number: slot i is free for position pos when seq == pos and
+ * holds the key for pos when seq == pos + 1 (Vyukov's bounded queue).
+ */
+// Power of two, so positions stay consistent when they wrap
+#define S76_INPUT_RING_SIZE 32
+
+struct s76_input_slot {
+	atomic_t seq;
+	unsigned int code;
+	u32 event;
+	ktime_t stamp;
+};
 
-static struct task_struct *s76_input_polling_task;
+static struct s76_input_slot s76_input_ring[S76_INPUT_RING_SIZE];
+static atomic_t s76_input_ring_head;
+static unsigned int s76_input_ring_tail;
 
-static void s76_input_key(unsigned int code)
+static void s76_input_ring_init(void)
 {
-	pr_debug("Send key %x\n", code);
+	int i;
 
-	mutex_lock(&s76_input_report_mutex);
+	for (i = 0; i < S76_INPUT_RING_SIZE; i++)
+		atomic_set(&s76_input_ring[i].seq, i);
 
-	input_report_key(s76_input_device, code, 1);
-	input_sync(s76_input_device);
+	atomic_set(&s76_input_ring_head, 0);
+	s76_input_ring_tail = 0;
+}
+
+static bool s76_input_ring_push(const struct s76_input_slot *key)
+{
+	struct s76_input_slot *slot;
+	int pos = atomic_read(&s76_input_ring_head);
+	int diff;
+
+	for (;;) {
+		slot = &s76_input_ring[(unsigned int)pos % S76_INPUT_RING_SIZE];
+		diff = atomic_read_acquire(&slot->seq) - pos;
+		if (diff == 0) {
+			if (atomic_try_cmpxchg_relaxed(&s76_input_ring_head, &pos, pos + 1))
+				break;
+		} else if (diff < 0) {
+			// The consumer has not freed this slot yet
+			return false;
+		} else {
+			pos = atomic_read(&s76_input_ring_head);
+		}
+	}
 
-	input_report_key(s76_input_device, code, 0);
-	input_sync(s76_input_device);
+	slot->code = key->code;
+	slot->event = key->event;
+	slot->stamp = key->stamp;
+	atomic_set_release(&slot->seq, pos + 1);
 
-	mutex_unlock(&s76_input_report_mutex);
+	return true;
 }
 
-static int s76_input_polling_thread(void *data)
+static bool s76_input_ring_pop(struct s76_input_slot *key)
 {
-	pr_debug("Polling thread started (PID: %i), polling at %i Hz\n",
-		 current->pid, param_poll_freq);
+	unsigned int pos = s76_input_ring_tail;
+	struct s76_input_slot *slot = &s76_input_ring[pos % S76_INPUT_RING_SIZE];
 
-	while (!kthread_should_stop()) {
-		u8 byte;
+	if ((unsigned int)atomic_read_acquire(&slot->seq) != pos + 1)
+		return false;
 
-		ec_read(0xDB, &byte);
-		if (byte & BIT(6)) {
-			ec_write(0xDB, byte & ~BIT(6));
+	key->code = slot->code;
+	key->event = slot->event;
+	key->stamp = slot->stamp;
+	atomic_set_release(&slot->seq, pos + S76_INPUT_RING_SIZE);
+	s76_input_ring_tail = pos + 1;
 
-			pr_debug("Airplane-Mode Hotkey pressed (EC)\n");
+	return true;
+}
 
-			s76_input_key(KEY_WLAN);
-		}
+// Cleared on close, the consumer then discards what is left in the ring
+static bool s76_input_opened;
+
+static void s76_input_report(struct work_struct *work)
+{
+	bool opened = READ_ONCE(s76_input_opened);
+	struct s76_input_slot key;
 
-		msleep_interruptible(1000 / param_poll_freq);
+	while (s76_input_ring_pop(&key)) {
+		if (!opened)
+			continue;
+
+		pr_debug("Send key %x\n", key.code);
+
+		// Press and release in separate frames, or they may be merged
+		input_report_key(s76_input_device, key.code, 1);
+		input_sync(s76_input_device);
+		input_report_key(s76_input_device, key.code, 0);
+		input_sync(s76_input_device);
+
+		s76_latency(key.event, S76_LATENCY_INPUT, key.stamp);
 	}
+}
 
-	pr_debug("Polling thread exiting\n");
+static DECLARE_WORK(s76_input_report_work, s76_input_report);
 
-	return 0;
+static void s76_input_key(unsigned int code, u32 event, ktime_t stamp)
+{
+	struct s76_input_slot key = {
+		.code = code,
+		.event = event,
+		.stamp = stamp,
+	};
+
+	if (!s76_input_ring_push(&key)) {
+		pr_warn_ratelimited("Hotkey queue full, dropped key %x\n", code);
+		return;
+	}
+
+	queue_work(system_highpri_wq, &s76_input_report_work);
+}
+
+/*
+ * The poller runs from a deferrable work item on a freezable workqueue. It
+ * does not wake an idle CPU, and it does not run between device suspend and
+ * resume. Its interval doubles from 1/poll_freq up to 1/POLL_FREQ_MIN once
+ * POLL_ACTIVE_MS have passed since the last key press.
+ */
+static unsigned long s76_input_poll_active;
+static unsigned int s76_input_poll_ms;
+
+static void s76_input_poll(struct work_struct *work);
+
+static DECLARE_DEFERRABLE_WORK(s76_input_poll_work, s76_input_poll);
+
+static void s76_input_poll(struct work_struct *work)
+{
+	unsigned int fast_ms = 1000 / READ_ONCE(param_poll_freq);
+	unsigned int slow_ms = 1000 / POLL_FREQ_MIN;
+	u8 byte;
+
+	if (!s76_ec_read(s76_model->ap_key, &byte) && (byte & BIT(6))) {
+		s76_ec_write(s76_model->ap_key, byte & ~BIT(6));
+
+		pr_debug("Airplane-Mode Hotkey pressed (EC)\n");
+
+		s76_input_key(KEY_WLAN, S76_EVENT_EC_POLL, ktime_get());
+
+		s76_input_poll_active = jiffies + msecs_to_jiffies(POLL_ACTIVE_MS);
+	}
+
+	if (time_before(jiffies, s76_input_poll_active))
+		s76_input_poll_ms = fast_ms;
+	else
+		s76_input_poll_ms = clamp(s76_input_poll_ms * 2, fast_ms, slow_ms);
+
+	queue_delayed_work(system_freezable_power_efficient_wq,
+			   &s76_input_poll_work,
+			   msecs_to_jiffies(s76_input_poll_ms));
 }
 
-static void s76_input_airplane_wmi(void)
+static void s76_input_airplane_wmi(u32 event, struct s76_event *ev)
 {
 	pr_debug("Airplane-Mode Hotkey pressed (WMI)\n");
 
-	s76_input_key(KEY_WLAN);
+	s76_input_key(KEY_WLAN, event, ev->stamp);
 }
 
-static void s76_input_screen_wmi(void)
+static void s76_input_screen_wmi(u32 event, struct s76_event *ev)
 {
 	pr_debug("Screen Hotkey pressed (WMI)\n");
 
-	s76_input_key(KEY_SCREENLOCK);
+	s76_input_key(KEY_SCREENLOCK, event, ev->stamp);
 }
 
 static int s76_input_open(struct input_dev *dev)
 {
-	int res = 0;
-
-	// Run polling thread if AP key driver is used and WMI is not supported
-	if ((driver_flags & (DRIVER_AP_KEY | DRIVER_AP_WMI)) == DRIVER_AP_KEY) {
-		s76_input_polling_task = kthread_run(s76_input_polling_thread,
-						     NULL, "system76-polld");
-
-		if (IS_ERR(s76_input_polling_task)) {
-			res = PTR_ERR(s76_input_polling_task);
-			s76_input_polling_task = NULL;
-			pr_err("Could not create polling thread: %d\n", res);
-			return res;
-		}
+	WRITE_ONCE(s76_input_opened, true);
+
+	// Poll if AP key driver is used and WMI is not supported
+	if (s76_has(DRIVER_AP_KEY) && !s76_has(DRIVER_AP_WMI)) {
+		pr_debug("Polling started, up to %i Hz\n", param_poll_freq);
+
+		s76_input_poll_active = jiffies + msecs_to_jiffies(POLL_ACTIVE_MS);
+		queue_delayed_work(system_freezable_power_efficient_wq,
+				   &s76_input_poll_work, 0);
 	}
 
-	return res;
+	return 0;
 }
 
 static void s76_input_close(struct input_dev *dev)
 {
-	if (IS_ERR_OR_NULL(s76_input_polling_task))
-		return;
-
-	kthread_stop(s76_input_polling_task);
-	s76_input_polling_task = NULL;
+	// Nothing polls while no one has the input device open
+	if (cancel_delayed_work_sync(&s76_input_poll_work))
+		pr_debug("Polling stopped\n");
+
+	/*
+	 * Run the consumer once more to empty the ring, so keys pressed while
+	 * the device was closed are not reported on the next open. Draining it
+	 * here instead could race with a consumer queued by a late key.
+	 */
+	WRITE_ONCE(s76_input_opened, false);
+	queue_work(system_highpri_wq, &s76_input_report_work);
+	flush_work(&s76_input_report_work);
 }
 
-static int __init s76_input_init(struct device *dev)
+static int s76_input_init(struct device *dev)
 {
 	u8 byte;
 
+	s76_input_ring_init();
+
 	s76_input_device = devm_input_allocate_device(dev);
 	if (!s76_input_device) {
 		pr_err("Error allocating input device\n");
@@ -138,13 +277,13 @@ static int __init s76_input_init(struct device *dev)
 	s76_input_device->id.bustype = BUS_HOST;
 	__set_bit(EV_KEY, s76_input_device->evbit);
 
-	if (driver_flags & DRIVER_AP_KEY) {
+	if (s76_has(DRIVER_AP_KEY)) {
 		input_set_capability(s76_input_device, EV_KEY, KEY_WLAN);
-		ec_read(0xDB, &byte);
-		ec_write(0xDB, byte & ~BIT(6));
+		if (!s76_ec_read(s76_model->ap_key, &byte))
+			s76_ec_write(s76_model->ap_key, byte & ~BIT(6));
 	}
 
-	if (driver_flags & DRIVER_OLED)
+	if (s76_has(DRIVER_OLED))
 		input_set_capability(s76_input_device, EV_KEY, KEY_SCREENLOCK);
 
 	s76_input_device->open  = s76_input_open;
@@ -152,3 +291,79 @@ static int __init s76_input_init(struct device *dev)
 
 	return input_register_device(s76_input_device);
 }
+
+static int s76_input_event(struct notifier_block *nb, unsigned long event,
+			   void *data)
+{
+	switch (event) {
+	case 0xD7:
+		if (!s76_has(DRIVER_OLED))
+			break;
+		s76_input_screen_wmi(event, data);
+		return NOTIFY_STOP;
+	case 0x85:
+	case 0xF4:
+		if (!s76_has(DRIVER_AP_KEY))
+			break;
+		s76_input_airplane_wmi(event, data);
+		return NOTIFY_STOP;
+	}
+
+	return NOTIFY_DONE;
+}
+
+static struct notifier_block s76_input_notifier = {
+	.notifier_call = s76_input_event,
+};
+
+static int s76_input_probe(struct platform_device *pdev)
+{
+	int err;
+
+	s76_model = s76_dev_model(&pdev->dev);
+	if (!s76_model)
+		return -ENODEV;
+
+	err = s76_input_init(&pdev->dev);
+	if (err) {
+		pr_err("Could not register input device\n");
+		return err;
+	}
+
+	return s76_event_register(&s76_input_notifier);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 11, 0)
+static void s76_input_remove(struct platform_device *pdev)
+#else
+static int s76_input_remove(struct platform_device *pdev)
+#endif
+{
+	s76_event_unregister(&s76_input_notifier);
+	cancel_work_sync(&s76_input_report_work);
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 11, 0)
+	return 0;
+#endif
+}
+
+static const struct platform_device_id s76_input_ids[] = {
+	{ S76_INPUT_NAME, 0 },
+	{ },
+};
+MODULE_DEVICE_TABLE(platform, s76_input_ids);
+
+static struct platform_driver s76_input_driver = {
+	.probe = s76_input_probe,
+	.remove = s76_input_remove,
+	.id_table = s76_input_ids,
+	.driver = {
+		.name = S76_INPUT_NAME,
+		.probe_type = PROBE_PREFER_ASYNCHRONOUS,
+	},
+};
+module_platform_driver(s76_input_driver);
+
+MODULE_AUTHOR("Jeremy Soller <jeremy@system76.com>");
+MODULE_DESCRIPTION("System76 hotkey driver");
+MODULE_LICENSE("GPL");
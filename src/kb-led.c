@@ -5,6 +5,29 @@
  * Copyright (C) 2017 Jeremy Soller <jeremy@system76.com>
  */
 
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/acpi.h>
+#include <linux/atomic.h>
+#include <linux/completion.h>
+#include <linux/hrtimer.h>
+#include <linux/kernel.h>
+#include <linux/led-class-multicolor.h>
+#include <linux/leds.h>
+#include <linux/miscdevice.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/platform_device.h>
+#include <linux/seqlock.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/version.h>
+#include <linux/workqueue.h>
+
+#include "system76.h"
+
+static const struct s76_model *s76_model;
+
 #define SET_KB_LED 0x67
 
 union kb_led_color {
@@ -12,12 +35,15 @@ union kb_led_color {
 	struct { u32 b:8, g:8, r:8, : 8; };
 };
 
-enum kb_led_region {
-	KB_LED_REGION_LEFT,
-	KB_LED_REGION_CENTER,
-	KB_LED_REGION_RIGHT,
-	KB_LED_REGION_EXTRA,
-};
+/*
+ * Firmware writes are serialized by kb_led_mutex. The cached state is
+ * published through kb_led_seq so readers never wait on a slow WMBB call.
+ */
+static DEFINE_MUTEX(kb_led_mutex);
+static seqcount_mutex_t kb_led_seq = SEQCNT_MUTEX_ZERO(kb_led_seq, &kb_led_mutex);
+
+// Writers wait for the resume restore so it does not overwrite them
+static DECLARE_COMPLETION(kb_led_restored);
 
 static enum led_brightness kb_led_brightness;
 
@@ -25,13 +51,29 @@ static enum led_brightness kb_led_toggle_brightness = 72;
 
 static enum led_brightness kb_led_levels[] = { 48, 72, 96, 144, 192, 255 };
 
-static union kb_led_color kb_led_regions[] = {
-	{ .rgb = 0xFFFFFF },
-	{ .rgb = 0xFFFFFF },
-	{ .rgb = 0xFFFFFF },
-	{ .rgb = 0xFFFFFF }
+// Indexed by the zones of s76_model->kb_zones
+static union kb_led_color kb_led_regions[S76_ZONES_MAX] = {
+	[0 ... S76_ZONES_MAX - 1] = { .rgb = 0xFFFFFF },
 };
 
+// Colors the firmware shows, effect frames among them
+static union kb_led_color kb_led_fw_regions[S76_ZONES_MAX];
+
+/*
+ * kb_led_brightness and kb_led_regions only change after a successful
+ * firmware call, or for zones an effect animates, once it is asked to show
+ * them. Bits set in kb_led_fw_known mark the brightness and the
+ * kb_led_fw_regions the firmware is known to still hold; writes of the same
+ * value to them are skipped. The firmware has no read-back, so bits are
+ * cleared when it may have lost them.
+ */
+#define KB_LED_FW_BRIGHTNESS BIT(ARRAY_SIZE(kb_led_regions))
+
+static unsigned long kb_led_fw_known;
+
+// Completed brightness and color writes, hotkey latency is only taken on one
+static unsigned int kb_led_fw_writes;
+
 static int kb_led_colors_i;
 
 static union kb_led_color kb_led_colors[] = {
@@ -44,50 +86,134 @@ static union kb_led_color kb_led_colors[] = {
 	{ .rgb = 0xFFFF00 }
 };
 
+// CIE 1931 lightness to luminance, perceived brightness steps become uniform
+static const u8 kb_led_cie1931[256] = {
+	  0,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   2,   2,
+	  2,   2,   2,   2,   2,   2,   2,   3,   3,   3,   3,   3,   3,   3,   3,   4,
+	  4,   4,   4,   4,   4,   5,   5,   5,   5,   5,   6,   6,   6,   6,   6,   7,
+	  7,   7,   7,   8,   8,   8,   8,   9,   9,   9,  10,  10,  10,  10,  11,  11,
+	 11,  12,  12,  12,  13,  13,  13,  14,  14,  15,  15,  15,  16,  16,  17,  17,
+	 17,  18,  18,  19,  19,  20,  20,  21,  21,  22,  22,  23,  23,  24,  24,  25,
+	 25,  26,  26,  27,  28,  28,  29,  29,  30,  31,  31,  32,  32,  33,  34,  34,
+	 35,  36,  37,  37,  38,  39,  39,  40,  41,  42,  43,  43,  44,  45,  46,  47,
+	 47,  48,  49,  50,  51,  52,  53,  54,  54,  55,  56,  57,  58,  59,  60,  61,
+	 62,  63,  64,  65,  66,  67,  68,  70,  71,  72,  73,  74,  75,  76,  77,  79,
+	 80,  81,  82,  83,  85,  86,  87,  88,  90,  91,  92,  94,  95,  96,  98,  99,
+	100, 102, 103, 105, 106, 108, 109, 110, 112, 113, 115, 116, 118, 120, 121, 123,
+	124, 126, 128, 129, 131, 132, 134, 136, 138, 139, 141, 143, 145, 146, 148, 150,
+	152, 154, 155, 157, 159, 161, 163, 165, 167, 169, 171, 173, 175, 177, 179, 181,
+	183, 185, 187, 189, 191, 193, 196, 198, 200, 202, 204, 207, 209, 211, 214, 216,
+	218, 220, 223, 225, 228, 230, 232, 235, 237, 240, 242, 245, 247, 250, 252, 255,
+};
+
+static bool kb_led_curve_cie1931;
+
+static u8 kb_led_fw_brightness(enum led_brightness value)
+{
+	return READ_ONCE(kb_led_curve_cie1931) ? kb_led_cie1931[value] : value;
+}
+
 static enum led_brightness kb_led_get(struct led_classdev *led_cdev)
 {
-	return kb_led_brightness;
+	enum led_brightness value;
+	unsigned int seq;
+
+	do {
+		seq = read_seqcount_begin(&kb_led_seq);
+		value = kb_led_brightness;
+	} while (read_seqcount_retry(&kb_led_seq, seq));
+
+	return value;
 }
 
-static int kb_led_set(struct led_classdev *led_cdev, enum led_brightness value)
+static int __kb_led_set(enum led_brightness value)
 {
+	int err;
+
+	lockdep_assert_held(&kb_led_mutex);
+
+	if ((kb_led_fw_known & KB_LED_FW_BRIGHTNESS) && value == kb_led_brightness)
+		return 0;
+
 	pr_debug("%s %d\n", __func__, (int)value);
 
-	if (!s76_wmbb(SET_KB_LED, 0xF4000000 | value, NULL))
-		kb_led_brightness = value;
+	err = s76_wmbb(SET_KB_LED, 0xF4000000 | kb_led_fw_brightness(value), NULL);
+	if (err)
+		return err;
+
+	write_seqcount_begin(&kb_led_seq);
+	kb_led_brightness = value;
+	write_seqcount_end(&kb_led_seq);
+	kb_led_fw_known |= KB_LED_FW_BRIGHTNESS;
+	kb_led_fw_writes++;
 
 	return 0;
 }
 
-static void kb_led_color_set_wmi(enum kb_led_region region, union kb_led_color color)
+static void kb_led_lock(void)
+{
+	wait_for_completion(&kb_led_restored);
+	mutex_lock(&kb_led_mutex);
+}
+
+/*
+ * Hotkeys are handled on the freezable event workqueue, which suspend waits
+ * to drain, so they must not sleep until the resume restore. They are
+ * dropped while it is pending instead.
+ */
+static bool kb_led_hotkey_lock(void)
+{
+	if (!completion_done(&kb_led_restored)) {
+		pr_debug("hotkey dropped, restore pending\n");
+		return false;
+	}
+
+	mutex_lock(&kb_led_mutex);
+	return true;
+}
+
+// Whether the hotkey wrote to the firmware since it took the lock
+static bool kb_led_hotkey_unlock(unsigned int writes)
+{
+	bool written = kb_led_fw_writes != writes;
+
+	mutex_unlock(&kb_led_mutex);
+	return written;
+}
+
+static void kb_led_region_update(unsigned int region, union kb_led_color color)
+{
+	write_seqcount_begin(&kb_led_seq);
+	kb_led_regions[region] = color;
+	write_seqcount_end(&kb_led_seq);
+}
+
+static void kb_led_fw_region_update(unsigned int region, union kb_led_color color)
+{
+	kb_led_fw_regions[region] = color;
+	kb_led_fw_known |= BIT(region);
+	kb_led_fw_writes++;
+}
+
+static int kb_led_color_set_wmi(unsigned int region, union kb_led_color color)
 {
 	u32 cmd;
+	int err;
 
-	pr_debug("%s %d %06X\n", __func__, (int)region, (int)color.rgb);
+	lockdep_assert_held(&kb_led_mutex);
 
-	switch (region) {
-	case KB_LED_REGION_LEFT:
-		cmd = 0xF0000000;
-		break;
-	case KB_LED_REGION_CENTER:
-		cmd = 0xF1000000;
-		break;
-	case KB_LED_REGION_RIGHT:
-		cmd = 0xF2000000;
-		break;
-	case KB_LED_REGION_EXTRA:
-		cmd = 0xF3000000;
-		break;
-	default:
-		return;
-	}
+	pr_debug("%s %d %06X\n", __func__, (int)region, (int)color.rgb);
 
+	cmd = s76_model->kb_zones[region].wmi;
 	cmd |= color.b << 16;
 	cmd |= color.r <<  8;
 	cmd |= color.g <<  0;
 
-	if (!s76_wmbb(SET_KB_LED, cmd, NULL))
-		kb_led_regions[region] = color;
+	err = s76_wmbb(SET_KB_LED, cmd, NULL);
+	if (!err)
+		kb_led_fw_region_update(region, color);
+
+	return err;
 }
 
 static acpi_status clevo_ec_locate(acpi_handle handle, u32 level,
@@ -98,7 +224,7 @@ static acpi_status clevo_ec_locate(acpi_handle handle, u32 level,
 }
 
 // HACK: Directly call ECMD to fix serw14
-static void kb_led_color_set(enum kb_led_region region, union kb_led_color color)
+static int kb_led_color_set(unsigned int region, union kb_led_color color)
 {
 	struct acpi_object_list input;
 	union acpi_object obj;
@@ -106,31 +232,21 @@ static void kb_led_color_set(enum kb_led_region region, union kb_led_color color
 	acpi_status status;
 	u8 *buf;
 
+	lockdep_assert_held(&kb_led_mutex);
+
 	buf = kzalloc(8, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
 
 	pr_debug("%s %d %06X\n", __func__, (int)region, (int)color.rgb);
 
 	buf[0] = 5;
 	buf[2] = 0xCA;
+	buf[3] = s76_model->kb_zones[region].ecmd;
 	buf[4] = color.b;
 	buf[5] = color.r;
 	buf[6] = color.g;
 
-	switch (region) {
-	case KB_LED_REGION_LEFT:
-		buf[3] = 0x03;
-		break;
-	case KB_LED_REGION_CENTER:
-		buf[3] = 0x04;
-		break;
-	case KB_LED_REGION_RIGHT:
-		buf[3] = 0x05;
-		break;
-	case KB_LED_REGION_EXTRA:
-		buf[3] = 0x0B;
-		break;
-	}
-
 	obj.type = ACPI_TYPE_BUFFER;
 	obj.buffer.length = 8;
 	obj.buffer.pointer = buf;
@@ -142,274 +258,1772 @@ static void kb_led_color_set(enum kb_led_region region, union kb_led_color color
 	status = acpi_get_devices("PNP0C09", clevo_ec_locate, NULL, &handle);
 	if (ACPI_FAILURE(status) || !handle) {
 		pr_err("failed to get EC handle: %s\n", acpi_format_exception(status));
-		return;
-	}
-
-	status = acpi_evaluate_object(handle, "ECMD", &input, NULL);
-	if (ACPI_FAILURE(status)) {
-		pr_err("failed to call ECMD: %s\n", acpi_format_exception(status));
-		return;
+		kfree(buf);
+		return -ENODEV;
 	}
 
-	// Update lightbar to match keyboard color
-	buf[3] = 0x07;
 	status = acpi_evaluate_object(handle, "ECMD", &input, NULL);
+	kfree(buf);
 	if (ACPI_FAILURE(status)) {
 		pr_err("failed to call ECMD: %s\n", acpi_format_exception(status));
-		return;
+		return -EIO;
 	}
 
-	kfree(buf);
-	kb_led_regions[region] = color;
+	kb_led_fw_region_update(region, color);
+	return 0;
 }
 
-static struct led_classdev kb_led = {
-	.name = "system76::kbd_backlight",
-	.flags = LED_BRIGHT_HW_CHANGED,
-	.brightness_get = kb_led_get,
-	.brightness_set_blocking = kb_led_set,
-	.max_brightness = 255,
-};
-
-static ssize_t kb_led_color_show(enum kb_led_region region, char *buf)
+// Number of color regions of this model
+static unsigned int kb_led_zones(void)
 {
-	return sysfs_emit(buf, "%06X\n", (int)kb_led_regions[region].rgb);
+	return min_t(unsigned int, s76_model->nr_kb_zones, ARRAY_SIZE(kb_led_regions));
 }
 
-static ssize_t kb_led_color_store(enum kb_led_region region, const char *buf, size_t size)
+// Show a color in a zone without making it the zone's color
+static int kb_led_zone_show(unsigned int region, union kb_led_color color)
 {
-	unsigned int val;
-	int ret;
-	union kb_led_color color;
+	lockdep_assert_held(&kb_led_mutex);
 
-	ret = kstrtouint(buf, 16, &val);
-	if (ret)
-		return ret;
+	if (!(s76_model->kb_zones[region].caps & S76_ZONE_COLOR))
+		return -EOPNOTSUPP;
 
-	color.rgb = (u32)val;
-	if (driver_flags & DRIVER_KB_LED_WMI)
-		kb_led_color_set_wmi(region, color);
-	else
-		kb_led_color_set(region, color);
+	if ((kb_led_fw_known & BIT(region)) && kb_led_fw_regions[region].rgb == color.rgb)
+		return 0;
 
-	return size;
+	if (s76_has(DRIVER_KB_LED_WMI))
+		return kb_led_color_set_wmi(region, color);
+	else
+		return kb_led_color_set(region, color);
 }
 
-static ssize_t kb_led_color_left_show(struct device *dev, struct device_attribute *attr, char *buf)
-{
-	return kb_led_color_show(KB_LED_REGION_LEFT, buf);
-}
+static bool kb_effect_owns(unsigned int region);
+static int kb_fw_mode_stop(void);
 
-static ssize_t kb_led_color_left_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t size)
+static int kb_led_zone_set(unsigned int region, union kb_led_color color)
 {
-	return kb_led_color_store(KB_LED_REGION_LEFT, buf, size);
-}
+	int err;
 
-static struct device_attribute kb_led_color_left_dev_attr = {
-	.attr = {
-		.name = "color_left",
-		.mode = 0644,
-	},
-	.show = kb_led_color_left_show,
-	.store = kb_led_color_left_store,
-};
+	lockdep_assert_held(&kb_led_mutex);
 
-static ssize_t kb_led_color_center_show(struct device *dev, struct device_attribute *attr, char *buf)
-{
-	return kb_led_color_show(KB_LED_REGION_CENTER, buf);
-}
+	// Shown once the effect animating the zone stops
+	if (kb_effect_owns(region)) {
+		kb_led_region_update(region, color);
+		return 0;
+	}
 
-static ssize_t kb_led_color_center_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t size)
-{
-	return kb_led_color_store(KB_LED_REGION_CENTER, buf, size);
+	err = kb_led_zone_show(region, color);
+	if (!err)
+		kb_led_region_update(region, color);
+
+	return err;
 }
 
-static struct device_attribute kb_led_color_center_dev_attr = {
-	.attr = {
-		.name = "color_center",
-		.mode = 0644,
-	},
-	.show = kb_led_color_center_show,
-	.store = kb_led_color_center_store,
+/*
+ * The multicolor intensities hold one color for the whole keyboard. The LED
+ * core applies them through brightness_set_blocking, so zones are only
+ * rewritten when the intensities differ from the color last applied.
+ */
+static struct mc_subled kb_led_subleds[] = {
+	{ .color_index = LED_COLOR_ID_RED, .intensity = 0xFF },
+	{ .color_index = LED_COLOR_ID_GREEN, .intensity = 0xFF },
+	{ .color_index = LED_COLOR_ID_BLUE, .intensity = 0xFF },
 };
 
-static ssize_t kb_led_color_right_show(struct device *dev, struct device_attribute *attr, char *buf)
+static union kb_led_color kb_led_mc_color = { .rgb = 0xFFFFFF };
+
+static void kb_led_mc_apply(void)
 {
-	return kb_led_color_show(KB_LED_REGION_RIGHT, buf);
+	unsigned int region;
+	union kb_led_color color = {
+		.r = kb_led_subleds[0].intensity,
+		.g = kb_led_subleds[1].intensity,
+		.b = kb_led_subleds[2].intensity,
+	};
+
+	lockdep_assert_held(&kb_led_mutex);
+
+	if (color.rgb == kb_led_mc_color.rgb || kb_fw_mode_stop())
+		return;
+
+	kb_led_mc_color = color;
+	for (region = 0; region < kb_led_zones(); region++)
+		kb_led_zone_set(region, color);
 }
 
-static ssize_t kb_led_color_right_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t size)
+// Record a color set for all zones outside of the multicolor interface
+static void kb_led_mc_update(union kb_led_color color)
 {
-	return kb_led_color_store(KB_LED_REGION_RIGHT, buf, size);
+	kb_led_subleds[0].intensity = color.r;
+	kb_led_subleds[1].intensity = color.g;
+	kb_led_subleds[2].intensity = color.b;
+	kb_led_mc_color = color;
 }
 
-static struct device_attribute kb_led_color_right_dev_attr = {
-	.attr = {
-		.name = "color_right",
-		.mode = 0644,
-	},
-	.show = kb_led_color_right_show,
-	.store = kb_led_color_right_store,
-};
+/*
+ * Brightness changes can ramp over kb_ramp_ms. The ramp work interpolates
+ * from the level at the time of the request to the target, with at most
+ * KB_RAMP_STEPS firmware writes. A new target restarts the ramp from the
+ * current level.
+ */
+#define KB_RAMP_STEPS		32
+#define KB_RAMP_MIN_STEP_MS	20
+#define KB_RAMP_MAX_MS		10000
 
-static ssize_t kb_led_color_extra_show(struct device *dev, struct device_attribute *attr, char *buf)
-{
-	return kb_led_color_show(KB_LED_REGION_EXTRA, buf);
-}
+static unsigned int kb_ramp_ms;
+
+// Protected by kb_led_mutex
+static bool kb_ramp_active;
+static enum led_brightness kb_ramp_from;
+static enum led_brightness kb_ramp_to;
+static ktime_t kb_ramp_start;
+static unsigned int kb_ramp_duration;
 
-static ssize_t kb_led_color_extra_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t size)
+static unsigned long kb_ramp_step(void)
 {
-	return kb_led_color_store(KB_LED_REGION_EXTRA, buf, size);
+	return msecs_to_jiffies(max_t(unsigned int, kb_ramp_duration / KB_RAMP_STEPS,
+				      KB_RAMP_MIN_STEP_MS));
 }
 
-static struct device_attribute kb_led_color_extra_dev_attr = {
-	.attr = {
-		.name = "color_extra",
-		.mode = 0644,
-	},
-	.show = kb_led_color_extra_show,
-	.store = kb_led_color_extra_store,
-};
+static void kb_ramp_work_fn(struct work_struct *work);
 
-static void kb_led_enable(void)
+static DECLARE_DELAYED_WORK(kb_ramp_work, kb_ramp_work_fn);
+
+static void kb_ramp_work_fn(struct work_struct *work)
 {
-	pr_debug("KBLED enable\n");
+	enum led_brightness value;
+	s64 elapsed;
 
-	s76_wmbb(SET_KB_LED, 0xE007F001, NULL);
-}
+	mutex_lock(&kb_led_mutex);
 
-static void kb_led_disable(void)
-{
-	pr_debug("KBLED disable\n");
+	if (!kb_ramp_active)
+		goto out;
 
-	s76_wmbb(SET_KB_LED, 0xE0003001, NULL);
+	elapsed = ktime_ms_delta(ktime_get(), kb_ramp_start);
+	if (elapsed >= kb_ramp_duration) {
+		value = kb_ramp_to;
+		kb_ramp_active = false;
+	} else {
+		value = kb_ramp_from + ((int)kb_ramp_to - (int)kb_ramp_from) *
+			(int)elapsed / (int)kb_ramp_duration;
+	}
+
+	__kb_led_set(value);
+
+	if (kb_ramp_active)
+		queue_delayed_work(system_highpri_wq, &kb_ramp_work, kb_ramp_step());
+
+out:
+	mutex_unlock(&kb_led_mutex);
 }
 
-static void kb_led_suspend(void)
+// The brightness the keyboard is at or ramping towards
+static enum led_brightness kb_led_target(void)
 {
-	// Disable keyboard backlight
-	kb_led_disable();
+	lockdep_assert_held(&kb_led_mutex);
+
+	return kb_ramp_active ? kb_ramp_to : kb_led_brightness;
 }
 
-static void kb_led_resume(void)
+static int kb_led_brightness_to(enum led_brightness value)
 {
-	enum kb_led_region region;
+	unsigned int duration = READ_ONCE(kb_ramp_ms);
 
-	// Disable keyboard backlight
-	kb_led_disable();
+	lockdep_assert_held(&kb_led_mutex);
 
-	// Reset current color
-	for (region = 0; region < ARRAY_SIZE(kb_led_regions); region++) {
-		if (driver_flags & DRIVER_KB_LED_WMI)
-			kb_led_color_set_wmi(region, kb_led_regions[region]);
-		else
-			kb_led_color_set(region, kb_led_regions[region]);
+	if (!duration || value == kb_led_brightness) {
+		kb_ramp_active = false;
+		return __kb_led_set(value);
 	}
 
-	// Reset current brightness
-	kb_led_set(&kb_led, kb_led_brightness);
+	pr_debug("%s %d -> %d over %ums\n", __func__, (int)kb_led_brightness,
+		 (int)value, duration);
 
-	// Enable keyboard backlight
-	kb_led_enable();
+	kb_ramp_from = kb_led_brightness;
+	kb_ramp_to = value;
+	kb_ramp_start = ktime_get();
+	kb_ramp_duration = duration;
+	kb_ramp_active = true;
+	mod_delayed_work(system_highpri_wq, &kb_ramp_work, 0);
+
+	return 0;
+}
+
+// Jump to the target of a running ramp
+static void kb_ramp_finish(void)
+{
+	cancel_delayed_work_sync(&kb_ramp_work);
+
+	mutex_lock(&kb_led_mutex);
+	if (kb_ramp_active) {
+		kb_ramp_active = false;
+		__kb_led_set(kb_ramp_to);
+	}
+	mutex_unlock(&kb_led_mutex);
 }
 
-static int __init kb_led_init(struct device *dev)
+static int kb_led_set(struct led_classdev *led_cdev, enum led_brightness value)
 {
 	int err;
 
-	err = devm_led_classdev_register(dev, &kb_led);
-	if (unlikely(err))
-		return err;
+	kb_led_lock();
+	err = kb_led_brightness_to(value);
+	if (!err)
+		kb_led_mc_apply();
+	mutex_unlock(&kb_led_mutex);
 
-	if (device_create_file(kb_led.dev, &kb_led_color_left_dev_attr) != 0)
-		pr_warn("failed to create kb_led_color_left\n");
+	return err;
+}
 
-	if (device_create_file(kb_led.dev, &kb_led_color_center_dev_attr) != 0)
-		pr_warn("failed to create kb_led_color_center\n");
+static struct led_classdev_mc kb_led = {
+	.led_cdev = {
+		.name = "system76::kbd_backlight",
+		.flags = LED_BRIGHT_HW_CHANGED,
+		.brightness_get = kb_led_get,
+		.brightness_set_blocking = kb_led_set,
+		.max_brightness = 255,
+	},
+	.num_colors = ARRAY_SIZE(kb_led_subleds),
+	.subled_info = kb_led_subleds,
+};
 
-	if (device_create_file(kb_led.dev, &kb_led_color_right_dev_attr) != 0)
-		pr_warn("failed to create kb_led_color_right\n");
+/*
+ * One color_<zone> attribute per zone of the model, named after its entry in
+ * the zone table. They are built at probe.
+ */
+struct kb_led_zone_attr {
+	struct device_attribute dev_attr;
+	char name[24];
+	unsigned int region;
+};
 
-	if (device_create_file(kb_led.dev, &kb_led_color_extra_dev_attr) != 0)
-		pr_warn("failed to create kb_led_color_extra\n");
+static struct kb_led_zone_attr kb_led_zone_attrs[S76_ZONES_MAX];
 
-	kb_led_resume();
+static ssize_t kb_led_color_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	unsigned int region = container_of(attr, struct kb_led_zone_attr, dev_attr)->region;
+	union kb_led_color color;
+	unsigned int seq;
 
-	return 0;
+	do {
+		seq = read_seqcount_begin(&kb_led_seq);
+		color = kb_led_regions[region];
+	} while (read_seqcount_retry(&kb_led_seq, seq));
+
+	return sysfs_emit(buf, "%06X\n", (int)color.rgb);
 }
 
-static void __exit kb_led_exit(void)
+static ssize_t kb_led_color_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t size)
 {
-	device_remove_file(kb_led.dev, &kb_led_color_extra_dev_attr);
-	device_remove_file(kb_led.dev, &kb_led_color_right_dev_attr);
-	device_remove_file(kb_led.dev, &kb_led_color_center_dev_attr);
-	device_remove_file(kb_led.dev, &kb_led_color_left_dev_attr);
+	unsigned int region = container_of(attr, struct kb_led_zone_attr, dev_attr)->region;
+	unsigned int val;
+	int ret;
+	union kb_led_color color;
+
+	ret = kstrtouint(buf, 16, &val);
+	if (ret)
+		return ret;
+
+	color.rgb = (u32)val;
+
+	kb_led_lock();
+	ret = kb_fw_mode_stop();
+	if (!ret)
+		kb_led_zone_set(region, color);
+	mutex_unlock(&kb_led_mutex);
+
+	return ret ? ret : size;
 }
 
-static void kb_wmi_brightness(enum led_brightness value)
+static struct device_attribute *kb_led_zone_attr_init(unsigned int region)
 {
-	pr_debug("%s %d\n", __func__, (int)value);
-
-	kb_led_set(&kb_led, value);
-	led_classdev_notify_brightness_hw_changed(&kb_led, value);
+	struct kb_led_zone_attr *zone_attr = &kb_led_zone_attrs[region];
+
+	snprintf(zone_attr->name, sizeof(zone_attr->name), "color_%s",
+		 s76_model->kb_zones[region].name);
+	sysfs_attr_init(&zone_attr->dev_attr.attr);
+	zone_attr->dev_attr.attr.name = zone_attr->name;
+	zone_attr->dev_attr.attr.mode = 0644;
+	zone_attr->dev_attr.show = kb_led_color_show;
+	zone_attr->dev_attr.store = kb_led_color_store;
+	zone_attr->region = region;
+
+	return &zone_attr->dev_attr;
 }
 
-static void kb_wmi_toggle(void)
+/*
+ * All zones at once, as hex colors separated by spaces. A single color is
+ * applied to every zone. The zones are written back to back under the lock.
+ */
+static ssize_t kb_led_colors_show(struct device *dev, struct device_attribute *attr, char *buf)
 {
-	if (kb_led_brightness > 0) {
-		kb_led_toggle_brightness = kb_led_brightness;
-		kb_wmi_brightness(LED_OFF);
-	} else {
-		kb_wmi_brightness(kb_led_toggle_brightness);
-	}
+	union kb_led_color colors[ARRAY_SIZE(kb_led_regions)];
+	unsigned int region;
+	unsigned int seq;
+	int len = 0;
+
+	do {
+		seq = read_seqcount_begin(&kb_led_seq);
+		memcpy(colors, kb_led_regions, sizeof(colors));
+	} while (read_seqcount_retry(&kb_led_seq, seq));
+
+	for (region = 0; region < kb_led_zones(); region++)
+		len += sysfs_emit_at(buf, len, "%s%06X", region ? " " : "",
+				     (int)colors[region].rgb);
+
+	return len + sysfs_emit_at(buf, len, "\n");
 }
 
-static void kb_wmi_dec(void)
+// Parse up to `max` hex colors separated by spaces, returns the count
+static int kb_led_colors_parse(const char *buf, union kb_led_color *colors,
+			       unsigned int max)
 {
-	int i;
+	unsigned int n = 0;
+	unsigned int val;
+	char *copy, *p, *tok;
+	int err = 0;
 
-	if (kb_led_brightness > 0) {
-		for (i = ARRAY_SIZE(kb_led_levels); i > 0; i--) {
-			if (kb_led_levels[i - 1] < kb_led_brightness) {
-				kb_wmi_brightness(kb_led_levels[i - 1]);
-				break;
-			}
+	copy = kstrdup(buf, GFP_KERNEL);
+	if (!copy)
+		return -ENOMEM;
+
+	p = strim(copy);
+	while ((tok = strsep(&p, " \t"))) {
+		if (!*tok)
+			continue;
+
+		if (n == max) {
+			err = -EINVAL;
+			break;
 		}
-	} else {
-		kb_wmi_toggle();
+
+		err = kstrtouint(tok, 16, &val);
+		if (err)
+			break;
+
+		if (val > 0xFFFFFF) {
+			err = -EINVAL;
+			break;
+		}
+
+		colors[n++].rgb = val;
 	}
+
+	kfree(copy);
+
+	return err ? err : n;
 }
 
-static void kb_wmi_inc(void)
+static ssize_t kb_led_colors_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t size)
 {
-	int i;
+	union kb_led_color colors[ARRAY_SIZE(kb_led_regions)];
+	unsigned int zones = kb_led_zones();
+	unsigned int region;
+	int ret;
 
-	if (kb_led_brightness > 0) {
-		for (i = 0; i < ARRAY_SIZE(kb_led_levels); i++) {
-			if (kb_led_levels[i] > kb_led_brightness) {
-				kb_wmi_brightness(kb_led_levels[i]);
-				break;
-			}
-		}
-	} else {
-		kb_wmi_toggle();
+	ret = kb_led_colors_parse(buf, colors, zones);
+	if (ret < 0)
+		return ret;
+
+	if (ret == 1) {
+		for (region = 1; region < zones; region++)
+			colors[region] = colors[0];
+	} else if (ret != zones) {
+		return -EINVAL;
 	}
+
+	kb_led_lock();
+	ret = kb_fw_mode_stop();
+	for (region = 0; !ret && region < kb_led_zones(); region++)
+		kb_led_zone_set(region, colors[region]);
+	mutex_unlock(&kb_led_mutex);
+
+	return ret ? ret : size;
+}
+
+static struct device_attribute kb_led_colors_dev_attr = {
+	.attr = {
+		.name = "colors",
+		.mode = 0644,
+	},
+	.show = kb_led_colors_show,
+	.store = kb_led_colors_store,
+};
+
+/*
+ * The firmware can animate the keyboard by itself, which costs no host CPU or
+ * wakeups. SET_KB_LED takes the mode in the top byte, "static" returns to the
+ * zone colors. The mode is applied again on every resume.
+ */
+enum kb_fw_mode {
+	KB_FW_MODE_STATIC,
+	KB_FW_MODE_BREATHE,
+	KB_FW_MODE_CYCLE,
+	KB_FW_MODE_DANCE,
+	KB_FW_MODE_FLASH,
+	KB_FW_MODE_RANDOM,
+	KB_FW_MODE_TEMPO,
+	KB_FW_MODE_WAVE,
+};
+
+static const char * const kb_fw_mode_names[] = {
+	[KB_FW_MODE_STATIC] = "static",
+	[KB_FW_MODE_BREATHE] = "breathe",
+	[KB_FW_MODE_CYCLE] = "cycle",
+	[KB_FW_MODE_DANCE] = "dance",
+	[KB_FW_MODE_FLASH] = "flash",
+	[KB_FW_MODE_RANDOM] = "random",
+	[KB_FW_MODE_TEMPO] = "tempo",
+	[KB_FW_MODE_WAVE] = "wave",
+};
+
+// SET_KB_LED mode words, static is the custom mode that shows the zone colors
+static const u32 kb_fw_mode_cmds[] = {
+	[KB_FW_MODE_STATIC] = 0x00000000,
+	[KB_FW_MODE_BREATHE] = 0x1002A000,
+	[KB_FW_MODE_CYCLE] = 0x33010000,
+	[KB_FW_MODE_DANCE] = 0x80000000,
+	[KB_FW_MODE_FLASH] = 0xA0000000,
+	[KB_FW_MODE_RANDOM] = 0x70000000,
+	[KB_FW_MODE_TEMPO] = 0x90000000,
+	[KB_FW_MODE_WAVE] = 0xB0000000,
+};
+
+// Protected by kb_led_mutex
+static enum kb_fw_mode kb_fw_mode;
+
+static int kb_fw_mode_apply(void)
+{
+	unsigned int region;
+	int err;
+
+	lockdep_assert_held(&kb_led_mutex);
+
+	pr_debug("%s %s\n", __func__, kb_fw_mode_names[kb_fw_mode]);
+
+	err = s76_wmbb(SET_KB_LED, kb_fw_mode_cmds[kb_fw_mode], NULL);
+	if (err)
+		return err;
+
+	// The animation overwrites the zone colors
+	kb_led_fw_known &= ~GENMASK(ARRAY_SIZE(kb_led_regions) - 1, 0);
+
+	if (kb_fw_mode != KB_FW_MODE_STATIC)
+		return 0;
+
+	for (region = 0; region < kb_led_zones(); region++)
+		kb_led_zone_set(region, kb_led_regions[region]);
+
+	return 0;
 }
 
-static void kb_wmi_color(void)
+// The mode is only switched once the firmware accepted it
+static int __kb_fw_mode_set(enum kb_fw_mode mode)
 {
-	enum kb_led_region region;
+	enum kb_fw_mode old = kb_fw_mode;
+	int err;
 
-	kb_led_colors_i += 1;
-	if (kb_led_colors_i >= ARRAY_SIZE(kb_led_colors))
-		kb_led_colors_i = 0;
+	lockdep_assert_held(&kb_led_mutex);
 
-	for (region = 0; region < ARRAY_SIZE(kb_led_regions); region++) {
-		if (driver_flags & DRIVER_KB_LED_WMI)
-			kb_led_color_set_wmi(region, kb_led_colors[kb_led_colors_i]);
-		else
-			kb_led_color_set(region, kb_led_colors[kb_led_colors_i]);
-	}
+	if (mode == old)
+		return 0;
 
-	led_classdev_notify_brightness_hw_changed(&kb_led, kb_led_brightness);
+	WRITE_ONCE(kb_fw_mode, mode);
+	err = kb_fw_mode_apply();
+	if (err)
+		WRITE_ONCE(kb_fw_mode, old);
+
+	return err;
 }
+
+// Zone colors only show in the static mode, writers switch to it first
+static int kb_fw_mode_stop(void)
+{
+	return __kb_fw_mode_set(KB_FW_MODE_STATIC);
+}
+
+/*
+ * Lighting effects are computed in the kernel. An hrtimer ticks every
+ * KB_EFFECT_FRAME_MS and queues kb_effect_work, which computes the frame
+ * from the elapsed time and writes the zones through kb_led_zone_show(), so
+ * zones that did not change are skipped. A tick that finds the previous
+ * frame still in flight is dropped.
+ */
+#define KB_EFFECT_FRAME_MS	50
+#define KB_EFFECT_COLORS	8
+
+enum kb_effect_type {
+	KB_EFFECT_NONE,
+	KB_EFFECT_BREATHE,
+	KB_EFFECT_CYCLE,
+	KB_EFFECT_WAVE,
+	KB_EFFECT_THERMAL,
+};
+
+static const char * const kb_effect_names[] = {
+	[KB_EFFECT_NONE] = "none",
+	[KB_EFFECT_BREATHE] = "breathe",
+	[KB_EFFECT_CYCLE] = "cycle",
+	[KB_EFFECT_WAVE] = "wave",
+	[KB_EFFECT_THERMAL] = "thermal",
+};
+
+// Effect parameters, protected by kb_led_mutex
+static enum kb_effect_type kb_effect_type;
+static unsigned int kb_effect_period_ms = 4000;
+static union kb_led_color kb_effect_palette[KB_EFFECT_COLORS];
+static unsigned int kb_effect_nr_colors;
+static unsigned long kb_effect_zones = GENMASK(ARRAY_SIZE(kb_led_regions) - 1, 0);
+static ktime_t kb_effect_start;
+
+static struct hrtimer kb_effect_timer;
+static atomic_t kb_effect_busy = ATOMIC_INIT(0);
+static atomic_t kb_effect_dropped = ATOMIC_INIT(0);
+
+/*
+ * Held from kb_effect_pause() until the effect is changed and resumed, so a
+ * concurrent change cannot resume the frames of one being replaced. Taken
+ * before kb_led_mutex.
+ */
+static DEFINE_MUTEX(kb_effect_ctl_mutex);
+
+/*
+ * Frames only reach the firmware. kb_led_regions keep the zone colors, which
+ * writes during the effect update, and are shown again when it stops.
+ */
+static bool kb_effect_owns(unsigned int region)
+{
+	lockdep_assert_held(&kb_led_mutex);
+
+	return kb_effect_type != KB_EFFECT_NONE && (kb_effect_zones & BIT(region));
+}
+
+static union kb_led_color kb_effect_blend(union kb_led_color a, union kb_led_color b,
+					  unsigned int f)
+{
+	union kb_led_color c = {
+		.r = a.r + ((int)b.r - (int)a.r) * (int)f / 255,
+		.g = a.g + ((int)b.g - (int)a.g) * (int)f / 255,
+		.b = a.b + ((int)b.b - (int)a.b) * (int)f / 255,
+	};
+
+	return c;
+}
+
+static union kb_led_color kb_effect_color(unsigned int region, u32 elapsed)
+{
+	static const union kb_led_color black = { .rgb = 0 };
+	unsigned int period = kb_effect_period_ms;
+	unsigned int n = kb_effect_nr_colors;
+	u32 t = elapsed % period;
+	unsigned int i, f;
+	u64 pos;
+
+	lockdep_assert_held(&kb_led_mutex);
+
+	switch (kb_effect_type) {
+	case KB_EFFECT_BREATHE:
+		// Fade each palette color in and out over one period
+		f = t * 510 / period;
+		if (f > 255)
+			f = 510 - f;
+		i = (elapsed / period) % n;
+		return kb_effect_blend(black, kb_effect_palette[i], f);
+	case KB_EFFECT_WAVE:
+		// Like cycle, with the zones spread out over one period
+		t = (t + region * period / kb_led_zones()) % period;
+		fallthrough;
+	case KB_EFFECT_CYCLE:
+		pos = (u64)t * n * 255;
+		pos = div_u64(pos, period);
+		i = (pos / 255) % n;
+		f = pos % 255;
+		return kb_effect_blend(kb_effect_palette[i],
+				       kb_effect_palette[(i + 1) % n], f);
+	default:
+		return kb_led_regions[region];
+	}
+}
+
+static void kb_effect_work_fn(struct work_struct *work)
+{
+	unsigned int region;
+	u32 elapsed;
+
+	mutex_lock(&kb_led_mutex);
+
+	if (kb_effect_type != KB_EFFECT_NONE) {
+		elapsed = ktime_ms_delta(ktime_get(), kb_effect_start);
+		for (region = 0; region < kb_led_zones(); region++) {
+			if (kb_effect_zones & BIT(region))
+				kb_led_zone_show(region, kb_effect_color(region, elapsed));
+		}
+	}
+
+	mutex_unlock(&kb_led_mutex);
+
+	atomic_set(&kb_effect_busy, 0);
+}
+
+static DECLARE_WORK(kb_effect_work, kb_effect_work_fn);
+
+static enum hrtimer_restart kb_effect_tick(struct hrtimer *timer)
+{
+	if (atomic_xchg(&kb_effect_busy, 1))
+		atomic_inc(&kb_effect_dropped);
+	else
+		queue_work(system_highpri_wq, &kb_effect_work);
+
+	hrtimer_forward_now(timer, ms_to_ktime(KB_EFFECT_FRAME_MS));
+
+	return HRTIMER_RESTART;
+}
+
+/*
+ * The thermal effect colors the keyboard after the hottest EC temperature
+ * sensor, interpolated along kb_thermal_gradient. It is polled from a
+ * deferrable work item instead of the frame timer. A reading is only shown
+ * once it is kb_thermal_hyst degrees away from the one shown, and zones are
+ * only written when the color changes.
+ */
+#define KB_THERMAL_POLL_MS	1000
+#define KB_THERMAL_POINTS	8
+
+struct kb_thermal_point {
+	u8 temp;	// Degrees Celsius, ascending along the gradient
+	union kb_led_color color;
+};
+
+// Protected by kb_led_mutex
+static struct kb_thermal_point kb_thermal_gradient[KB_THERMAL_POINTS] = {
+	{ 40, { .rgb = 0x0000FF } },
+	{ 70, { .rgb = 0xFFFF00 } },
+	{ 90, { .rgb = 0xFF0000 } },
+};
+static unsigned int kb_thermal_nr_points = 3;
+static unsigned int kb_thermal_hyst = 2;
+// Temperature the keyboard shows, -1 before the first reading
+static int kb_thermal_shown = -1;
+
+static int kb_thermal_read(void)
+{
+	int temp = -ENODEV;
+	unsigned int i;
+	u8 value;
+
+	for (i = 0; i < s76_model->nr_temps; i++) {
+		if (!s76_ec_read(s76_model->temps[i].reg, &value))
+			temp = max_t(int, temp, value);
+	}
+
+	return temp;
+}
+
+static union kb_led_color kb_thermal_color(int temp)
+{
+	const struct kb_thermal_point *lo, *hi;
+	unsigned int i;
+
+	lockdep_assert_held(&kb_led_mutex);
+
+	for (i = 1; i < kb_thermal_nr_points; i++) {
+		lo = &kb_thermal_gradient[i - 1];
+		hi = &kb_thermal_gradient[i];
+		if (temp < hi->temp) {
+			if (temp <= lo->temp)
+				return lo->color;
+			return kb_effect_blend(lo->color, hi->color,
+					       (temp - lo->temp) * 255 / (hi->temp - lo->temp));
+		}
+	}
+
+	return kb_thermal_gradient[kb_thermal_nr_points - 1].color;
+}
+
+static void kb_thermal_work_fn(struct work_struct *work);
+
+static DECLARE_DEFERRABLE_WORK(kb_thermal_work, kb_thermal_work_fn);
+
+static void kb_thermal_work_fn(struct work_struct *work)
+{
+	union kb_led_color color;
+	unsigned int region;
+	int temp;
+
+	temp = kb_thermal_read();
+
+	mutex_lock(&kb_led_mutex);
+
+	if (kb_effect_type != KB_EFFECT_THERMAL)
+		goto out;
+
+	if (temp >= 0 && (kb_thermal_shown < 0 ||
+			  abs(temp - kb_thermal_shown) >= kb_thermal_hyst)) {
+		kb_thermal_shown = temp;
+		color = kb_thermal_color(temp);
+		for (region = 0; region < kb_led_zones(); region++) {
+			if (kb_effect_zones & BIT(region))
+				kb_led_zone_show(region, color);
+		}
+	}
+
+	queue_delayed_work(system_freezable_power_efficient_wq, &kb_thermal_work,
+			   msecs_to_jiffies(KB_THERMAL_POLL_MS));
+
+out:
+	mutex_unlock(&kb_led_mutex);
+}
+
+static void kb_effect_init(void)
+{
+	kb_effect_nr_colors = min_t(unsigned int, ARRAY_SIZE(kb_led_colors),
+				    KB_EFFECT_COLORS);
+	memcpy(kb_effect_palette, kb_led_colors,
+	       kb_effect_nr_colors * sizeof(*kb_effect_palette));
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+	hrtimer_setup(&kb_effect_timer, kb_effect_tick, CLOCK_MONOTONIC,
+		      HRTIMER_MODE_REL);
+#else
+	hrtimer_init(&kb_effect_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	kb_effect_timer.function = kb_effect_tick;
+#endif
+}
+
+// Called without kb_led_mutex, the frame work takes it
+static void kb_effect_pause(void)
+{
+	hrtimer_cancel(&kb_effect_timer);
+	cancel_work_sync(&kb_effect_work);
+	atomic_set(&kb_effect_busy, 0);
+	cancel_delayed_work_sync(&kb_thermal_work);
+}
+
+static void kb_effect_resume(void)
+{
+	enum kb_effect_type type;
+
+	mutex_lock(&kb_led_mutex);
+	type = kb_effect_type;
+	kb_thermal_shown = -1;
+	mutex_unlock(&kb_led_mutex);
+
+	if (type == KB_EFFECT_THERMAL)
+		mod_delayed_work(system_freezable_power_efficient_wq, &kb_thermal_work, 0);
+	else if (type != KB_EFFECT_NONE)
+		hrtimer_start(&kb_effect_timer, 0, HRTIMER_MODE_REL);
+}
+
+// The thermal effect reads the EC sensors the hwmon driver checked for
+static bool kb_effect_available(enum kb_effect_type type)
+{
+	if (type == KB_EFFECT_THERMAL)
+		return s76_has(DRIVER_HWMON) && s76_model->nr_temps;
+
+	return true;
+}
+
+static ssize_t kb_effect_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	enum kb_effect_type type = READ_ONCE(kb_effect_type);
+	int len = 0;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(kb_effect_names); i++) {
+		if (!kb_effect_available(i))
+			continue;
+		len += sysfs_emit_at(buf, len, i == type ? "%s[%s]" : "%s%s",
+				     i ? " " : "", kb_effect_names[i]);
+	}
+
+	return len + sysfs_emit_at(buf, len, "\n");
+}
+
+// Return to the colors set before the effect, the frame work must be paused
+static void __kb_effect_stop(void)
+{
+	unsigned int region;
+
+	lockdep_assert_held(&kb_led_mutex);
+
+	if (kb_effect_type == KB_EFFECT_NONE)
+		return;
+
+	WRITE_ONCE(kb_effect_type, KB_EFFECT_NONE);
+	for (region = 0; region < kb_led_zones(); region++)
+		kb_led_zone_show(region, kb_led_regions[region]);
+}
+
+static ssize_t kb_effect_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t size)
+{
+	int type;
+
+	type = sysfs_match_string(kb_effect_names, buf);
+	if (type < 0)
+		return type;
+
+	if (!kb_effect_available(type))
+		return -ENODEV;
+
+	mutex_lock(&kb_effect_ctl_mutex);
+	kb_effect_pause();
+
+	kb_led_lock();
+	if (type == KB_EFFECT_NONE) {
+		__kb_effect_stop();
+	} else {
+		// Only one of the host and firmware effects can run
+		__kb_fw_mode_set(KB_FW_MODE_STATIC);
+		WRITE_ONCE(kb_effect_type, type);
+		kb_effect_start = ktime_get();
+	}
+	mutex_unlock(&kb_led_mutex);
+
+	kb_effect_resume();
+	mutex_unlock(&kb_effect_ctl_mutex);
+
+	return size;
+}
+
+static struct device_attribute kb_effect_dev_attr =
+	__ATTR(effect, 0644, kb_effect_show, kb_effect_store);
+
+static ssize_t kb_effect_period_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%u\n", READ_ONCE(kb_effect_period_ms));
+}
+
+static ssize_t kb_effect_period_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t size)
+{
+	unsigned int val;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &val);
+	if (ret)
+		return ret;
+
+	if (val < KB_EFFECT_FRAME_MS || val > 60000)
+		return -EINVAL;
+
+	mutex_lock(&kb_led_mutex);
+	WRITE_ONCE(kb_effect_period_ms, val);
+	mutex_unlock(&kb_led_mutex);
+
+	return size;
+}
+
+static struct device_attribute kb_effect_period_dev_attr =
+	__ATTR(effect_period_ms, 0644, kb_effect_period_show, kb_effect_period_store);
+
+static ssize_t kb_effect_palette_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	int len = 0;
+	int i;
+
+	mutex_lock(&kb_led_mutex);
+	for (i = 0; i < kb_effect_nr_colors; i++)
+		len += sysfs_emit_at(buf, len, "%s%06X", i ? " " : "",
+				     (int)kb_effect_palette[i].rgb);
+	mutex_unlock(&kb_led_mutex);
+
+	return len + sysfs_emit_at(buf, len, "\n");
+}
+
+static ssize_t kb_effect_palette_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t size)
+{
+	union kb_led_color colors[KB_EFFECT_COLORS];
+	int ret;
+
+	ret = kb_led_colors_parse(buf, colors, KB_EFFECT_COLORS);
+	if (ret < 0)
+		return ret;
+
+	if (!ret)
+		return -EINVAL;
+
+	mutex_lock(&kb_led_mutex);
+	memcpy(kb_effect_palette, colors, ret * sizeof(*colors));
+	kb_effect_nr_colors = ret;
+	mutex_unlock(&kb_led_mutex);
+
+	return size;
+}
+
+static struct device_attribute kb_effect_palette_dev_attr =
+	__ATTR(effect_palette, 0644, kb_effect_palette_show, kb_effect_palette_store);
+
+static ssize_t kb_effect_zones_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%#lx\n", READ_ONCE(kb_effect_zones));
+}
+
+static ssize_t kb_effect_zones_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t size)
+{
+	unsigned long val, released;
+	unsigned int region;
+	int ret;
+
+	ret = kstrtoul(buf, 0, &val);
+	if (ret)
+		return ret;
+
+	if (val & ~GENMASK(ARRAY_SIZE(kb_led_regions) - 1, 0))
+		return -EINVAL;
+
+	mutex_lock(&kb_led_mutex);
+	released = kb_effect_zones & ~val;
+	WRITE_ONCE(kb_effect_zones, val);
+
+	// Zones the effect no longer animates return to their colors
+	if (kb_effect_type != KB_EFFECT_NONE) {
+		for (region = 0; region < kb_led_zones(); region++) {
+			if (released & BIT(region))
+				kb_led_zone_show(region, kb_led_regions[region]);
+		}
+	}
+	mutex_unlock(&kb_led_mutex);
+
+	return size;
+}
+
+static struct device_attribute kb_effect_zones_dev_attr =
+	__ATTR(effect_zones, 0644, kb_effect_zones_show, kb_effect_zones_store);
+
+static ssize_t kb_effect_dropped_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%d\n", atomic_read(&kb_effect_dropped));
+}
+
+static struct device_attribute kb_effect_dropped_dev_attr =
+	__ATTR(effect_dropped, 0444, kb_effect_dropped_show, NULL);
+
+static ssize_t kb_fw_mode_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	enum kb_fw_mode mode = READ_ONCE(kb_fw_mode);
+	int len = 0;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(kb_fw_mode_names); i++)
+		len += sysfs_emit_at(buf, len, i == mode ? "%s[%s]" : "%s%s",
+				     i ? " " : "", kb_fw_mode_names[i]);
+
+	return len + sysfs_emit_at(buf, len, "\n");
+}
+
+static ssize_t kb_fw_mode_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t size)
+{
+	int mode;
+	int err;
+
+	mode = sysfs_match_string(kb_fw_mode_names, buf);
+	if (mode < 0)
+		return mode;
+
+	mutex_lock(&kb_effect_ctl_mutex);
+	kb_effect_pause();
+
+	kb_led_lock();
+	__kb_effect_stop();
+	err = __kb_fw_mode_set(mode);
+	mutex_unlock(&kb_led_mutex);
+
+	mutex_unlock(&kb_effect_ctl_mutex);
+
+	return err ? err : size;
+}
+
+static struct device_attribute kb_fw_mode_dev_attr =
+	__ATTR(fw_effect, 0644, kb_fw_mode_show, kb_fw_mode_store);
+
+/*
+ * Frames written to /dev/system76-kbd set all zones at once:
+ *
+ *   u8 zones, u8 flags, u8 brightness, u8 reserved, then zones * { r, g, b }
+ *
+ * One color sets every zone, and the brightness is only applied when flags
+ * has KB_STREAM_BRIGHTNESS. Each write() must hold exactly one frame. The
+ * newest frame replaces one the worker has not picked up yet, which is
+ * counted in stream_dropped.
+ */
+#define KB_STREAM_BRIGHTNESS	BIT(0)
+
+struct kb_stream_frame {
+	u8 zones;
+	u8 flags;
+	u8 brightness;
+	u8 reserved;
+	u8 rgb[ARRAY_SIZE(kb_led_regions)][3];
+} __packed;
+
+static DEFINE_SPINLOCK(kb_stream_lock);
+// Protected by kb_stream_lock
+static struct kb_stream_frame kb_stream_pending;
+static bool kb_stream_queued;
+static atomic_t kb_stream_dropped = ATOMIC_INIT(0);
+
+static void kb_stream_work_fn(struct work_struct *work)
+{
+	struct kb_stream_frame frame;
+	unsigned int region;
+	union kb_led_color color;
+	unsigned int i;
+
+	spin_lock(&kb_stream_lock);
+	frame = kb_stream_pending;
+	kb_stream_queued = false;
+	spin_unlock(&kb_stream_lock);
+
+	kb_led_lock();
+
+	// An effect started after the frame was queued wins
+	if (kb_effect_type == KB_EFFECT_NONE && kb_fw_mode == KB_FW_MODE_STATIC) {
+		for (region = 0; region < kb_led_zones(); region++) {
+			i = frame.zones == 1 ? 0 : region;
+			color.r = frame.rgb[i][0];
+			color.g = frame.rgb[i][1];
+			color.b = frame.rgb[i][2];
+			kb_led_zone_set(region, color);
+		}
+
+		// Listeners only hear about actual changes, not every frame
+		if ((frame.flags & KB_STREAM_BRIGHTNESS) &&
+		    frame.brightness != kb_led_target()) {
+			kb_ramp_active = false;
+			if (!__kb_led_set(frame.brightness))
+				led_classdev_notify_brightness_hw_changed(&kb_led.led_cdev,
+									  frame.brightness);
+		}
+	}
+
+	mutex_unlock(&kb_led_mutex);
+}
+
+static DECLARE_WORK(kb_stream_work, kb_stream_work_fn);
+
+static ssize_t kb_stream_write(struct file *file, const char __user *buf,
+			       size_t count, loff_t *ppos)
+{
+	struct kb_stream_frame frame = {};
+	size_t len = offsetof(struct kb_stream_frame, rgb);
+
+	if (count < len || count > sizeof(frame))
+		return -EINVAL;
+
+	if (copy_from_user(&frame, buf, count))
+		return -EFAULT;
+
+	if (frame.zones == 0 || count != len + frame.zones * sizeof(frame.rgb[0]))
+		return -EINVAL;
+
+	if (frame.zones != 1 && frame.zones != kb_led_zones())
+		return -EINVAL;
+
+	if (READ_ONCE(kb_effect_type) != KB_EFFECT_NONE ||
+	    READ_ONCE(kb_fw_mode) != KB_FW_MODE_STATIC)
+		return -EBUSY;
+
+	spin_lock(&kb_stream_lock);
+	if (kb_stream_queued)
+		atomic_inc(&kb_stream_dropped);
+	kb_stream_pending = frame;
+	kb_stream_queued = true;
+	spin_unlock(&kb_stream_lock);
+
+	queue_work(system_highpri_wq, &kb_stream_work);
+
+	return count;
+}
+
+static const struct file_operations kb_stream_fops = {
+	.owner = THIS_MODULE,
+	.write = kb_stream_write,
+	.llseek = noop_llseek,
+};
+
+static struct miscdevice kb_stream_dev = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "system76-kbd",
+	.fops = &kb_stream_fops,
+};
+
+static bool kb_stream_registered;
+
+static ssize_t kb_stream_dropped_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%d\n", atomic_read(&kb_stream_dropped));
+}
+
+static struct device_attribute kb_stream_dropped_dev_attr =
+	__ATTR(stream_dropped, 0444, kb_stream_dropped_show, NULL);
+
+static ssize_t kb_thermal_gradient_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	int len = 0;
+	int i;
+
+	mutex_lock(&kb_led_mutex);
+	for (i = 0; i < kb_thermal_nr_points; i++)
+		len += sysfs_emit_at(buf, len, "%s%u:%06X", i ? " " : "",
+				     kb_thermal_gradient[i].temp,
+				     (int)kb_thermal_gradient[i].color.rgb);
+	mutex_unlock(&kb_led_mutex);
+
+	return len + sysfs_emit_at(buf, len, "\n");
+}
+
+// Points as <celsius>:<rrggbb> separated by spaces, in ascending order
+static ssize_t kb_thermal_gradient_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t size)
+{
+	struct kb_thermal_point points[KB_THERMAL_POINTS];
+	char *copy, *p, *tok, *color;
+	unsigned int n = 0;
+	unsigned int val;
+	int err = 0;
+
+	copy = kstrdup(buf, GFP_KERNEL);
+	if (!copy)
+		return -ENOMEM;
+
+	p = strim(copy);
+	while (!err && (tok = strsep(&p, " \t"))) {
+		if (!*tok)
+			continue;
+
+		color = strchr(tok, ':');
+		if (!color || n == KB_THERMAL_POINTS) {
+			err = -EINVAL;
+			break;
+		}
+		*color++ = '\0';
+
+		err = kstrtou8(tok, 10, &points[n].temp);
+		if (err)
+			break;
+
+		err = kstrtouint(color, 16, &val);
+		if (err)
+			break;
+
+		if (val > 0xFFFFFF || (n && points[n].temp <= points[n - 1].temp)) {
+			err = -EINVAL;
+			break;
+		}
+
+		points[n++].color.rgb = val;
+	}
+
+	kfree(copy);
+
+	if (!err && !n)
+		err = -EINVAL;
+	if (err)
+		return err;
+
+	mutex_lock(&kb_led_mutex);
+	memcpy(kb_thermal_gradient, points, n * sizeof(*points));
+	kb_thermal_nr_points = n;
+	// Show the new gradient with the next reading
+	kb_thermal_shown = -1;
+	mutex_unlock(&kb_led_mutex);
+
+	return size;
+}
+
+static struct device_attribute kb_thermal_gradient_dev_attr =
+	__ATTR(thermal_gradient, 0644, kb_thermal_gradient_show, kb_thermal_gradient_store);
+
+static ssize_t kb_thermal_hyst_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%u\n", READ_ONCE(kb_thermal_hyst));
+}
+
+static ssize_t kb_thermal_hyst_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t size)
+{
+	unsigned int val;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &val);
+	if (ret)
+		return ret;
+
+	if (val > 20)
+		return -EINVAL;
+
+	mutex_lock(&kb_led_mutex);
+	WRITE_ONCE(kb_thermal_hyst, val);
+	mutex_unlock(&kb_led_mutex);
+
+	return size;
+}
+
+static struct device_attribute kb_thermal_hyst_dev_attr =
+	__ATTR(thermal_hysteresis, 0644, kb_thermal_hyst_show, kb_thermal_hyst_store);
+
+static ssize_t kb_ramp_ms_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%u\n", READ_ONCE(kb_ramp_ms));
+}
+
+static ssize_t kb_ramp_ms_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t size)
+{
+	unsigned int val;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &val);
+	if (ret)
+		return ret;
+
+	if (val > KB_RAMP_MAX_MS)
+		return -EINVAL;
+
+	WRITE_ONCE(kb_ramp_ms, val);
+
+	return size;
+}
+
+static struct device_attribute kb_ramp_ms_dev_attr =
+	__ATTR(brightness_transition_ms, 0644, kb_ramp_ms_show, kb_ramp_ms_store);
+
+static const char * const kb_led_curve_names[] = { "linear", "cie1931" };
+
+static ssize_t kb_led_curve_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	bool cie1931 = READ_ONCE(kb_led_curve_cie1931);
+
+	return sysfs_emit(buf, cie1931 ? "%s [%s]\n" : "[%s] %s\n",
+			  kb_led_curve_names[0], kb_led_curve_names[1]);
+}
+
+static ssize_t kb_led_curve_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t size)
+{
+	int curve;
+
+	curve = sysfs_match_string(kb_led_curve_names, buf);
+	if (curve < 0)
+		return curve;
+
+	// Ramp steps in flight were computed for the old curve
+	kb_ramp_finish();
+
+	kb_led_lock();
+	if (curve != kb_led_curve_cie1931) {
+		WRITE_ONCE(kb_led_curve_cie1931, curve);
+		// Send the current level again through the new curve
+		kb_led_fw_known &= ~KB_LED_FW_BRIGHTNESS;
+		__kb_led_set(kb_led_brightness);
+	}
+	mutex_unlock(&kb_led_mutex);
+
+	return size;
+}
+
+static struct device_attribute kb_led_curve_dev_attr =
+	__ATTR(brightness_curve, 0644, kb_led_curve_show, kb_led_curve_store);
+
+static struct attribute *kb_effect_attrs[] = {
+	&kb_led_curve_dev_attr.attr,
+	&kb_ramp_ms_dev_attr.attr,
+	&kb_fw_mode_dev_attr.attr,
+	&kb_effect_dev_attr.attr,
+	&kb_effect_period_dev_attr.attr,
+	&kb_effect_palette_dev_attr.attr,
+	&kb_effect_zones_dev_attr.attr,
+	&kb_effect_dropped_dev_attr.attr,
+	&kb_thermal_gradient_dev_attr.attr,
+	&kb_thermal_hyst_dev_attr.attr,
+	&kb_stream_dropped_dev_attr.attr,
+	NULL
+};
+
+static umode_t kb_effect_attr_visible(struct kobject *kobj, struct attribute *attr, int n)
+{
+	unsigned int region;
+
+	if (attr == &kb_thermal_gradient_dev_attr.attr ||
+	    attr == &kb_thermal_hyst_dev_attr.attr)
+		return kb_effect_available(KB_EFFECT_THERMAL) ? attr->mode : 0;
+
+	if (attr != &kb_fw_mode_dev_attr.attr)
+		return attr->mode;
+
+	// The firmware modes are SET_KB_LED commands, ECMD zones do not take them
+	for (region = 0; region < kb_led_zones(); region++) {
+		if (s76_model->kb_zones[region].caps & S76_ZONE_FW_EFFECT)
+			return attr->mode;
+	}
+
+	return 0;
+}
+
+static const struct attribute_group kb_effect_group = {
+	.attrs = kb_effect_attrs,
+	.is_visible = kb_effect_attr_visible,
+};
+
+static void kb_led_enable(void)
+{
+	pr_debug("KBLED enable\n");
+
+	s76_wmbb(SET_KB_LED, 0xE007F001, NULL);
+}
+
+static void kb_led_disable(void)
+{
+	pr_debug("KBLED disable\n");
+
+	s76_wmbb(SET_KB_LED, 0xE0003001, NULL);
+}
+
+static void kb_led_suspend(void)
+{
+	mutex_lock(&kb_led_mutex);
+
+	// Disable keyboard backlight
+	kb_led_disable();
+
+	mutex_unlock(&kb_led_mutex);
+}
+
+/*
+ * Probe starts with nothing known and kb_led_fw_forget() runs on every
+ * resume, so this is always a full restore of colors and brightness.
+ */
+static void kb_led_resume(void)
+{
+	unsigned int region;
+
+	mutex_lock(&kb_led_mutex);
+
+	pr_debug("KBLED restore\n");
+
+	// Disable keyboard backlight
+	kb_led_disable();
+
+	// Reset colors
+	for (region = 0; region < kb_led_zones(); region++)
+		kb_led_zone_set(region, kb_led_regions[region]);
+
+	// Reset brightness
+	__kb_led_set(kb_led_brightness);
+
+	// Enable keyboard backlight
+	kb_led_enable();
+
+	if (kb_fw_mode != KB_FW_MODE_STATIC)
+		kb_fw_mode_apply();
+
+	mutex_unlock(&kb_led_mutex);
+}
+
+static void kb_led_restore_work_fn(struct work_struct *work)
+{
+	ktime_t start;
+
+	s76_wait_ready();
+
+	start = ktime_get();
+	kb_led_resume();
+	s76_stage("kb_restore", start);
+	complete_all(&kb_led_restored);
+
+	mutex_lock(&kb_effect_ctl_mutex);
+	kb_effect_resume();
+	mutex_unlock(&kb_effect_ctl_mutex);
+}
+
+static DECLARE_WORK(kb_led_restore_work, kb_led_restore_work_fn);
+
+static int kb_led_init(struct device *dev)
+{
+	ktime_t start = ktime_get();
+	unsigned int region;
+	int err;
+
+#if IS_ENABLED(CONFIG_LEDS_CLASS_MULTICOLOR)
+	err = devm_led_classdev_multicolor_register(dev, &kb_led);
+#else
+	err = devm_led_classdev_register(dev, &kb_led.led_cdev);
+#endif
+	if (unlikely(err))
+		return err;
+
+	for (region = 0; region < kb_led_zones(); region++) {
+		if (!(s76_model->kb_zones[region].caps & S76_ZONE_COLOR))
+			continue;
+		if (device_create_file(kb_led.led_cdev.dev, kb_led_zone_attr_init(region)) != 0)
+			pr_warn("failed to create %s\n", kb_led_zone_attrs[region].name);
+	}
+
+	if (device_create_file(kb_led.led_cdev.dev, &kb_led_colors_dev_attr) != 0)
+		pr_warn("failed to create colors\n");
+
+	kb_effect_init();
+	if (sysfs_create_group(&kb_led.led_cdev.dev->kobj, &kb_effect_group) != 0)
+		pr_warn("failed to create effect attributes\n");
+
+	kb_stream_dev.parent = kb_led.led_cdev.dev;
+	if (misc_register(&kb_stream_dev) != 0)
+		pr_warn("failed to register %s\n", kb_stream_dev.name);
+	else
+		kb_stream_registered = true;
+
+	s76_stage("kb_led_register", start);
+
+	// The initial restore waits for the core to enable the firmware
+	reinit_completion(&kb_led_restored);
+	queue_work(system_unbound_wq, &kb_led_restore_work);
+
+	return 0;
+}
+
+static void kb_led_exit(void)
+{
+	unsigned int region;
+
+	if (kb_stream_registered) {
+		misc_deregister(&kb_stream_dev);
+		kb_stream_registered = false;
+	}
+	cancel_work_sync(&kb_stream_work);
+	cancel_delayed_work_sync(&kb_ramp_work);
+
+	sysfs_remove_group(&kb_led.led_cdev.dev->kobj, &kb_effect_group);
+	kb_effect_pause();
+
+	device_remove_file(kb_led.led_cdev.dev, &kb_led_colors_dev_attr);
+
+	for (region = kb_led_zones(); region > 0; region--) {
+		if (s76_model->kb_zones[region - 1].caps & S76_ZONE_COLOR)
+			device_remove_file(kb_led.led_cdev.dev,
+					   &kb_led_zone_attrs[region - 1].dev_attr);
+	}
+}
+
+static void kb_wmi_brightness(enum led_brightness value)
+{
+	pr_debug("%s %d\n", __func__, (int)value);
+
+	kb_led_brightness_to(value);
+	led_classdev_notify_brightness_hw_changed(&kb_led.led_cdev, value);
+}
+
+static void __kb_wmi_toggle(void)
+{
+	lockdep_assert_held(&kb_led_mutex);
+
+	if (kb_led_target() > 0) {
+		kb_led_toggle_brightness = kb_led_target();
+		kb_wmi_brightness(LED_OFF);
+	} else {
+		kb_wmi_brightness(kb_led_toggle_brightness);
+	}
+}
+
+static bool kb_wmi_toggle(void)
+{
+	unsigned int writes;
+
+	if (!kb_led_hotkey_lock())
+		return false;
+
+	writes = kb_led_fw_writes;
+	__kb_wmi_toggle();
+
+	return kb_led_hotkey_unlock(writes);
+}
+
+static bool kb_wmi_dec(void)
+{
+	unsigned int writes;
+	int i;
+
+	if (!kb_led_hotkey_lock())
+		return false;
+
+	writes = kb_led_fw_writes;
+
+	if (kb_led_target() > 0) {
+		for (i = ARRAY_SIZE(kb_led_levels); i > 0; i--) {
+			if (kb_led_levels[i - 1] < kb_led_target()) {
+				kb_wmi_brightness(kb_led_levels[i - 1]);
+				break;
+			}
+		}
+	} else {
+		__kb_wmi_toggle();
+	}
+
+	return kb_led_hotkey_unlock(writes);
+}
+
+static bool kb_wmi_inc(void)
+{
+	unsigned int writes;
+	int i;
+
+	if (!kb_led_hotkey_lock())
+		return false;
+
+	writes = kb_led_fw_writes;
+
+	if (kb_led_target() > 0) {
+		for (i = 0; i < ARRAY_SIZE(kb_led_levels); i++) {
+			if (kb_led_levels[i] > kb_led_target()) {
+				kb_wmi_brightness(kb_led_levels[i]);
+				break;
+			}
+		}
+	} else {
+		__kb_wmi_toggle();
+	}
+
+	return kb_led_hotkey_unlock(writes);
+}
+
+static bool kb_wmi_color(void)
+{
+	unsigned int region;
+	unsigned int writes;
+
+	if (!kb_led_hotkey_lock())
+		return false;
+
+	writes = kb_led_fw_writes;
+
+	if (kb_fw_mode_stop())
+		return kb_led_hotkey_unlock(writes);
+
+	kb_led_colors_i += 1;
+	if (kb_led_colors_i >= ARRAY_SIZE(kb_led_colors))
+		kb_led_colors_i = 0;
+
+	for (region = 0; region < kb_led_zones(); region++)
+		kb_led_zone_set(region, kb_led_colors[kb_led_colors_i]);
+	kb_led_mc_update(kb_led_colors[kb_led_colors_i]);
+
+	led_classdev_notify_brightness_hw_changed(&kb_led.led_cdev, kb_led_target());
+
+	return kb_led_hotkey_unlock(writes);
+}
+
+static int kb_led_event(struct notifier_block *nb, unsigned long event,
+			void *data)
+{
+	struct s76_event *ev = data;
+	bool written;
+
+	switch (event) {
+	case 0x81:
+		written = kb_wmi_dec();
+		break;
+	case 0x82:
+		written = kb_wmi_inc();
+		break;
+	case 0x83:
+		written = kb_wmi_color();
+		break;
+	case 0x9F:
+		written = kb_wmi_toggle();
+		break;
+	default:
+		return NOTIFY_DONE;
+	}
+
+	// Dropped keys, ramps only queued and unchanged values are not timed
+	if (written)
+		s76_latency(event, S76_LATENCY_LED, ev->stamp);
+
+	return NOTIFY_STOP;
+}
+
+static struct notifier_block kb_led_notifier = {
+	.notifier_call = kb_led_event,
+};
+
+// Apply the lighting of a profile in one pass under the lock
+static int kb_led_profile(struct notifier_block *nb, unsigned long action,
+			  void *data)
+{
+	struct s76_profile_ctx *ctx = data;
+	const struct s76_profile *profile = ctx->profile;
+	bool colors = profile->set & S76_PROFILE_KB_COLORS;
+	union kb_led_color color;
+	unsigned int region;
+	int err = 0;
+
+	if (!(profile->set & (S76_PROFILE_KB_BRIGHTNESS | S76_PROFILE_KB_COLORS)))
+		return NOTIFY_DONE;
+
+	ctx->handled |= profile->set & (S76_PROFILE_KB_BRIGHTNESS | S76_PROFILE_KB_COLORS);
+	if (action == S76_PROFILE_CHECK)
+		return NOTIFY_OK;
+
+	// A brightness alone is applied on top of running effects
+	if (colors) {
+		mutex_lock(&kb_effect_ctl_mutex);
+		kb_effect_pause();
+	}
+
+	kb_led_lock();
+
+	if (colors) {
+		__kb_effect_stop();
+		err = kb_fw_mode_stop();
+
+		for (region = 0; !err && region < kb_led_zones(); region++) {
+			color.rgb = profile->kb_colors[profile->nr_kb_colors == 1 ? 0 : region];
+			if (s76_model->kb_zones[region].caps & S76_ZONE_COLOR)
+				err = kb_led_zone_set(region, color);
+		}
+		if (!err && profile->nr_kb_colors == 1)
+			kb_led_mc_update(color);
+	}
+
+	if (!err && (profile->set & S76_PROFILE_KB_BRIGHTNESS)) {
+		err = kb_led_brightness_to(profile->kb_brightness);
+		if (!err)
+			led_classdev_notify_brightness_hw_changed(&kb_led.led_cdev,
+								  profile->kb_brightness);
+	}
+
+	mutex_unlock(&kb_led_mutex);
+
+	if (colors)
+		mutex_unlock(&kb_effect_ctl_mutex);
+
+	return notifier_from_errno(err);
+}
+
+static struct notifier_block kb_led_profile_notifier = {
+	.notifier_call = kb_led_profile,
+	.priority = S76_PROFILE_PRIO_KB,
+};
+
+static int kb_led_probe(struct platform_device *pdev)
+{
+	int err;
+
+	s76_model = s76_dev_model(&pdev->dev);
+	if (!s76_model)
+		return -ENODEV;
+
+	err = kb_led_init(&pdev->dev);
+	if (err) {
+		pr_err("Could not register LED device\n");
+		return err;
+	}
+
+	err = s76_event_register(&kb_led_notifier);
+	if (!err) {
+		err = s76_profile_register(&kb_led_profile_notifier);
+		if (err)
+			s76_event_unregister(&kb_led_notifier);
+	}
+	if (err) {
+		cancel_work_sync(&kb_led_restore_work);
+		complete_all(&kb_led_restored);
+		kb_led_exit();
+	}
+
+	return err;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 11, 0)
+static void kb_led_remove(struct platform_device *pdev)
+#else
+static int kb_led_remove(struct platform_device *pdev)
+#endif
+{
+	s76_profile_unregister(&kb_led_profile_notifier);
+	s76_event_unregister(&kb_led_notifier);
+	cancel_work_sync(&kb_led_restore_work);
+	complete_all(&kb_led_restored);
+	kb_led_exit();
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 11, 0)
+	return 0;
+#endif
+}
+
+/*
+ * Whether the EC keeps the LED state through suspend to idle is not known for
+ * every model, so after any sleep all values are written again.
+ */
+static void kb_led_fw_forget(void)
+{
+	mutex_lock(&kb_led_mutex);
+	kb_led_fw_known = 0;
+	mutex_unlock(&kb_led_mutex);
+}
+
+static int __maybe_unused kb_led_pm_suspend(struct device *dev)
+{
+	pr_debug("suspend\n");
+
+	mutex_lock(&kb_effect_ctl_mutex);
+	kb_effect_pause();
+	mutex_unlock(&kb_effect_ctl_mutex);
+	kb_ramp_finish();
+	flush_work(&kb_stream_work);
+	flush_work(&kb_led_restore_work);
+	reinit_completion(&kb_led_restored);
+	kb_led_suspend();
+
+	return 0;
+}
+
+static int __maybe_unused kb_led_pm_resume(struct device *dev)
+{
+	pr_debug("resume\n");
+
+	kb_led_fw_forget();
+
+	queue_work(system_unbound_wq, &kb_led_restore_work);
+
+	return 0;
+}
+
+static int __maybe_unused kb_led_pm_restore(struct device *dev)
+{
+	pr_debug("restore\n");
+
+	kb_led_fw_forget();
+
+	queue_work(system_unbound_wq, &kb_led_restore_work);
+
+	return 0;
+}
+
+static const struct dev_pm_ops kb_led_pm = {
+	.suspend = kb_led_pm_suspend,
+	.resume = kb_led_pm_resume,
+	.freeze = kb_led_pm_suspend,
+	.thaw = kb_led_pm_resume,
+	.poweroff = kb_led_pm_suspend,
+	.restore = kb_led_pm_restore,
+};
+
+static const struct platform_device_id kb_led_ids[] = {
+	{ S76_KB_LED_NAME, 0 },
+	{ },
+};
+MODULE_DEVICE_TABLE(platform, kb_led_ids);
+
+static struct platform_driver kb_led_driver = {
+	.probe = kb_led_probe,
+	.remove = kb_led_remove,
+	.id_table = kb_led_ids,
+	.driver = {
+		.name = S76_KB_LED_NAME,
+		.probe_type = PROBE_PREFER_ASYNCHRONOUS,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 17, 0)
+		.pm = pm_sleep_ptr(&kb_led_pm),
+#else
+		.pm = pm_ptr(&kb_led_pm),
+#endif
+	},
+};
+module_platform_driver(kb_led_driver);
+
+MODULE_AUTHOR("Jeremy Soller <jeremy@system76.com>");
+MODULE_DESCRIPTION("System76 keyboard backlight driver");
+MODULE_LICENSE("GPL");
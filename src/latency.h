@@ -0,0 +1,125 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * latency.h
+ *
+ * Hotkey latency from the firmware notification to the input event sync or
+ * to the completed LED firmware call. The last S76_LATENCY_SAMPLES samples
+ * of each event code and stage are kept, and debugfs prints one line per
+ * series:
+ *
+ *   <event> <stage> <samples> <p50_us> <p90_us> <p99_us> <max_us>
+ */
+
+#ifndef _S76_LATENCY_H
+#define _S76_LATENCY_H
+
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/seq_file.h>
+#include <linux/sort.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+
+#define S76_LATENCY_SAMPLES	64
+#define S76_LATENCY_SERIES	16
+
+enum s76_latency_stage {
+	S76_LATENCY_INPUT,
+	S76_LATENCY_LED,
+};
+
+struct s76_latency_series {
+	u32 event;
+	enum s76_latency_stage stage;
+	// Samples recorded so far, the newest is samples_us[(count - 1) % S76_LATENCY_SAMPLES]
+	unsigned int count;
+	u32 samples_us[S76_LATENCY_SAMPLES];
+};
+
+struct s76_latency {
+	spinlock_t lock;
+	unsigned int nr_series;
+	struct s76_latency_series series[S76_LATENCY_SERIES];
+};
+
+#define DEFINE_S76_LATENCY(name) \
+	struct s76_latency name = { .lock = __SPIN_LOCK_UNLOCKED(name.lock) }
+
+// Record the time from `stamp` until now; dropped once all series are used
+static inline void s76_latency_add(struct s76_latency *l, u32 event,
+				   enum s76_latency_stage stage, ktime_t stamp)
+{
+	s64 us = ktime_us_delta(ktime_get(), stamp);
+	struct s76_latency_series *series = NULL;
+	unsigned int i;
+
+	spin_lock(&l->lock);
+	for (i = 0; i < l->nr_series; i++) {
+		if (l->series[i].event == event && l->series[i].stage == stage) {
+			series = &l->series[i];
+			break;
+		}
+	}
+
+	if (!series && l->nr_series < S76_LATENCY_SERIES) {
+		series = &l->series[l->nr_series++];
+		series->event = event;
+		series->stage = stage;
+		series->count = 0;
+	}
+
+	if (series)
+		series->samples_us[series->count++ % S76_LATENCY_SAMPLES] =
+			clamp_t(s64, us, 0, U32_MAX);
+	spin_unlock(&l->lock);
+}
+
+static inline int s76_latency_cmp(const void *a, const void *b)
+{
+	u32 x = *(const u32 *)a;
+	u32 y = *(const u32 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+// Nearest-rank percentile of `n` sorted samples
+static inline u32 s76_latency_pct(const u32 *sorted, unsigned int n,
+				  unsigned int pct)
+{
+	return sorted[max(DIV_ROUND_UP(n * pct, 100), 1U) - 1];
+}
+
+static inline void s76_latency_show(struct seq_file *m, struct s76_latency *l)
+{
+	static const char * const stages[] = {
+		[S76_LATENCY_INPUT] = "input",
+		[S76_LATENCY_LED] = "led",
+	};
+	u32 sorted[S76_LATENCY_SAMPLES];
+	enum s76_latency_stage stage;
+	unsigned int i, n;
+	u32 event;
+
+	for (i = 0; ; i++) {
+		spin_lock(&l->lock);
+		if (i >= l->nr_series) {
+			spin_unlock(&l->lock);
+			break;
+		}
+		event = l->series[i].event;
+		stage = l->series[i].stage;
+		n = min_t(unsigned int, l->series[i].count, S76_LATENCY_SAMPLES);
+		memcpy(sorted, l->series[i].samples_us, n * sizeof(*sorted));
+		spin_unlock(&l->lock);
+
+		sort(sorted, n, sizeof(*sorted), s76_latency_cmp, NULL);
+
+		seq_printf(m, "%#x %s %u %u %u %u %u\n", event, stages[stage], n,
+			   s76_latency_pct(sorted, n, 50),
+			   s76_latency_pct(sorted, n, 90),
+			   s76_latency_pct(sorted, n, 99),
+			   sorted[n - 1]);
+	}
+}
+
+#endif // _S76_LATENCY_H
@@ -9,49 +9,196 @@
 
 #define S76_DRIVER_NAME KBUILD_MODNAME
 #define pr_fmt(fmt) S76_DRIVER_NAME ": " fmt
+#define S76_ZONES_DEFINE
 
 #include <linux/acpi.h>
+#include <linux/atomic.h>
+#include <linux/completion.h>
+#include <linux/debugfs.h>
 #include <linux/delay.h>
 #include <linux/dmi.h>
-#include <linux/hwmon.h>
-#include <linux/hwmon-sysfs.h>
 #include <linux/i8042.h>
-#include <linux/input.h>
 #include <linux/kernel.h>
-#include <linux/kthread.h>
-#include <linux/leds.h>
+#include <linux/ktime.h>
 #include <linux/module.h>
-#include <linux/mutex.h>
-#include <linux/pci.h>
+#include <linux/notifier.h>
 #include <linux/platform_device.h>
-#include <linux/pm_runtime.h>
-#include <linux/reboot.h>
-#include <linux/rfkill.h>
-#include <linux/stringify.h>
+#include <linux/seq_file.h>
+#include <linux/spinlock.h>
 #include <linux/version.h>
 #include <linux/workqueue.h>
 
+#include "system76.h"
+#include "timeline.h"
+
 #define S76_EVENT_GUID		"ABBC0F6B-8EA1-11D1-00A0-C90629100000"
 #define S76_WMBB_GUID		"ABBC0F6D-8EA1-11D1-00A0-C90629100000"
 
 /* method IDs for S76_GET */
 #define GET_EVENT               0x01  /*   1 */
 
-#define DRIVER_AP_KEY		BIT(0)
-#define DRIVER_AP_LED		BIT(1)
-#define DRIVER_HWMON		BIT(2)
-#define DRIVER_KB_LED_WMI	BIT(3)
-#define DRIVER_OLED		BIT(4)
-#define DRIVER_AP_WMI		BIT(5)
-#define DRIVER_KB_LED		BIT(6)
+static const struct s76_fan s76_fans[] = {
+	{ "CPU fan", 0xD0, 0xCE },
+	{ "GPU fan", 0xD2, 0xCF },
+};
 
-#define DRIVER_INPUT  (DRIVER_AP_KEY | DRIVER_OLED)
+static const struct s76_temp s76_temps[] = {
+	{ "CPU temperature", 0x07 },
+	{ "GPU temperature", 0xCD },
+};
 
-static u64 driver_flags;
+#define S76_MODEL_DESC(sym, product, data, ...) \
+static const struct s76_model s76_model_##sym = { \
+	.name = product, \
+	.features = (data), \
+	.ap_led = 0xD9, \
+	.ap_key = 0xDB, \
+	.kb_zones = s76_zones_wmi, \
+	.nr_kb_zones = ARRAY_SIZE(s76_zones_wmi), \
+	.resume_timeout_ms = 2000, \
+	__VA_ARGS__ \
+};
+
+S76_MODEL_LIST(S76_MODEL_DESC)
+
+#define S76_MODEL_REF(sym, product, data, ...) \
+	(S76_MODEL_ENABLED(sym) ? &s76_model_##sym : NULL),
+
+static const struct s76_model * const s76_models[] __initconst = {
+	S76_MODEL_LIST(S76_MODEL_REF)
+};
+
+static const struct s76_model *s76_model;
+
+static char *param_model;
+module_param_named(model, param_model, charp, 0444);
+MODULE_PARM_DESC(model, "Use the descriptor of this model instead of the detected one (for testing)");
 
 struct platform_device *s76_platform_device;
 
-static int s76_wmbb(u32 method_id, u32 arg, u32 *retval)
+/*
+ * Firmware interface health tracking
+ *
+ * A wedged EC makes every access wait for the full EC timeout. After
+ * S76_HEALTH_THRESHOLD consecutive failures an interface is marked as down
+ * and accesses fail fast with -EIO. Once the backoff expires a single access
+ * is let through as a probe; each failed probe doubles the backoff.
+ *
+ * Only timeouts and transport errors count as failures. A method or
+ * register the firmware rejects says nothing about whether it responds.
+ */
+#define S76_HEALTH_THRESHOLD		3
+#define S76_HEALTH_BACKOFF_MIN_MS	250
+#define S76_HEALTH_BACKOFF_MAX_MS	30000
+
+struct s76_health {
+	const char *name;
+	spinlock_t lock;
+	unsigned int failures;
+	unsigned int backoff_ms;
+	unsigned long retry_at;
+	bool probing;
+};
+
+#define S76_HEALTH_INIT(_var, _name) { \
+	.name = _name, \
+	.lock = __SPIN_LOCK_UNLOCKED(_var.lock), \
+}
+
+static struct s76_health s76_ec_health = S76_HEALTH_INIT(s76_ec_health, "EC");
+static struct s76_health s76_wmi_health = S76_HEALTH_INIT(s76_wmi_health, "WMI");
+
+static bool s76_health_begin(struct s76_health *health)
+{
+	bool allow = true;
+
+	spin_lock(&health->lock);
+	if (health->failures >= S76_HEALTH_THRESHOLD) {
+		if (health->probing || time_before(jiffies, health->retry_at))
+			allow = false;
+		else
+			health->probing = true;
+	}
+	spin_unlock(&health->lock);
+
+	return allow;
+}
+
+static bool s76_health_failure(int err)
+{
+	return err == -ETIME || err == -EIO;
+}
+
+static void s76_health_end(struct s76_health *health, int err)
+{
+	spin_lock(&health->lock);
+	health->probing = false;
+
+	if (!s76_health_failure(err)) {
+		if (health->failures >= S76_HEALTH_THRESHOLD)
+			pr_info("%s responding again\n", health->name);
+		health->failures = 0;
+		health->backoff_ms = 0;
+	} else if (health->failures < S76_HEALTH_THRESHOLD) {
+		health->failures++;
+		if (health->failures == S76_HEALTH_THRESHOLD) {
+			pr_warn("%s not responding (%d), backing off\n",
+				health->name, err);
+			health->backoff_ms = S76_HEALTH_BACKOFF_MIN_MS;
+			health->retry_at = jiffies + msecs_to_jiffies(health->backoff_ms);
+		}
+	} else {
+		health->backoff_ms = min_t(unsigned int, health->backoff_ms * 2,
+					   S76_HEALTH_BACKOFF_MAX_MS);
+		health->retry_at = jiffies + msecs_to_jiffies(health->backoff_ms);
+	}
+	spin_unlock(&health->lock);
+}
+
+int s76_ec_read(u8 addr, u8 *val)
+{
+	int err;
+
+	if (!s76_health_begin(&s76_ec_health))
+		return -EIO;
+
+	err = ec_read(addr, val);
+	s76_health_end(&s76_ec_health, err);
+
+	return err;
+}
+EXPORT_SYMBOL_GPL(s76_ec_read);
+
+int s76_ec_write(u8 addr, u8 val)
+{
+	int err;
+
+	if (!s76_health_begin(&s76_ec_health))
+		return -EIO;
+
+	err = ec_write(addr, val);
+	s76_health_end(&s76_ec_health, err);
+
+	return err;
+}
+EXPORT_SYMBOL_GPL(s76_ec_write);
+
+int s76_ec_transaction(u8 command, const u8 *wdata, unsigned int wdata_len,
+		       u8 *rdata, unsigned int rdata_len)
+{
+	int err;
+
+	if (!s76_health_begin(&s76_ec_health))
+		return -EIO;
+
+	err = ec_transaction(command, wdata, wdata_len, rdata, rdata_len);
+	s76_health_end(&s76_ec_health, err);
+
+	return err;
+}
+EXPORT_SYMBOL_GPL(s76_ec_transaction);
+
+static int __s76_wmbb(u32 method_id, u32 arg, u32 *retval)
 {
 	struct acpi_buffer in  = { (acpi_size)sizeof(arg), &arg };
 	struct acpi_buffer out = { ACPI_ALLOCATE_BUFFER, NULL };
@@ -63,14 +210,28 @@ static int s76_wmbb(u32 method_id, u32 arg, u32 *retval)
 
 	status = wmi_evaluate_method(S76_WMBB_GUID, 0, method_id, &in, &out);
 
-	if (unlikely(ACPI_FAILURE(status)))
+	if (unlikely(ACPI_FAILURE(status))) {
+		pr_debug("%0#4x  failed: %s\n", method_id, acpi_format_exception(status));
+		if (status == AE_TIME)
+			return -ETIME;
+		// The method or its argument is not supported by this firmware
+		if (status == AE_NOT_FOUND || status == AE_NOT_EXIST ||
+		    status == AE_SUPPORT || (status & AE_CODE_MASK) == AE_CODE_AML)
+			return -EOPNOTSUPP;
 		return -EIO;
+	}
 
 	obj = (union acpi_object *)out.pointer;
-	if (obj && obj->type == ACPI_TYPE_INTEGER)
+	if (obj && obj->type == ACPI_TYPE_INTEGER) {
 		tmp = (u32)obj->integer.value;
-	else
+	} else if (retval) {
+		// The caller asked for a result and did not get one
+		pr_debug("%0#4x  no result\n", method_id);
+		kfree(obj);
+		return -ENODATA;
+	} else {
 		tmp = 0;
+	}
 
 	pr_debug("%0#4x  OUT: %0#6x (IN: %0#6x)\n", method_id, tmp, arg);
 
@@ -82,10 +243,198 @@ static int s76_wmbb(u32 method_id, u32 arg, u32 *retval)
 	return 0;
 }
 
-#include "ap-led.c"
-#include "input.c"
-#include "kb-led.c"
-#include "hwmon.c"
+int s76_wmbb(u32 method_id, u32 arg, u32 *retval)
+{
+	int err;
+
+	if (!s76_health_begin(&s76_wmi_health))
+		return -EIO;
+
+	err = __s76_wmbb(method_id, arg, retval);
+	s76_health_end(&s76_wmi_health, err);
+
+	return err;
+}
+EXPORT_SYMBOL_GPL(s76_wmbb);
+
+static BLOCKING_NOTIFIER_HEAD(s76_event_chain);
+
+int s76_event_register(struct notifier_block *nb)
+{
+	return blocking_notifier_chain_register(&s76_event_chain, nb);
+}
+EXPORT_SYMBOL_GPL(s76_event_register);
+
+void s76_event_unregister(struct notifier_block *nb)
+{
+	blocking_notifier_chain_unregister(&s76_event_chain, nb);
+}
+EXPORT_SYMBOL_GPL(s76_event_unregister);
+
+static BLOCKING_NOTIFIER_HEAD(s76_profile_chain);
+
+int s76_profile_register(struct notifier_block *nb)
+{
+	return blocking_notifier_chain_register(&s76_profile_chain, nb);
+}
+EXPORT_SYMBOL_GPL(s76_profile_register);
+
+void s76_profile_unregister(struct notifier_block *nb)
+{
+	blocking_notifier_chain_unregister(&s76_profile_chain, nb);
+}
+EXPORT_SYMBOL_GPL(s76_profile_unregister);
+
+static DEFINE_S76_TIMELINES(s76_timelines);
+
+void s76_stage(const char *name, ktime_t start)
+{
+	s76_timeline_add(&s76_timelines, name, start);
+}
+EXPORT_SYMBOL_GPL(s76_stage);
+
+static DEFINE_S76_LATENCY(s76_latencies);
+
+void s76_latency(u32 event, enum s76_latency_stage stage, ktime_t stamp)
+{
+	s76_latency_add(&s76_latencies, event, stage, stamp);
+}
+EXPORT_SYMBOL_GPL(s76_latency);
+
+static int s76_latencies_show(struct seq_file *m, void *unused)
+{
+	s76_latency_show(m, &s76_latencies);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(s76_latencies);
+
+static int s76_timelines_show(struct seq_file *m, void *unused)
+{
+	s76_timeline_show(m, &s76_timelines);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(s76_timelines);
+
+static struct dentry *s76_debugfs;
+
+struct s76_feature {
+	const char *name;
+	u64 flags;
+};
+
+static const struct s76_feature s76_features[] = {
+	{ S76_AP_LED_NAME, DRIVER_AP_LED },
+	{ S76_KB_LED_NAME, DRIVER_KB_LED_WMI | DRIVER_KB_LED },
+	{ S76_INPUT_NAME, DRIVER_INPUT },
+#if IS_ENABLED(CONFIG_HWMON)
+	{ S76_HWMON_NAME, DRIVER_HWMON },
+#endif
+};
+
+static struct platform_device *s76_feature_devices[ARRAY_SIZE(s76_features)];
+
+/*
+ * The notify handler counts notifications and queues s76_event_work. The
+ * worker reads one event per notification counted since its last pass, up to
+ * S76_EVENT_DRAIN_MAX, and stops early when the firmware returns 0. Events
+ * that arrive while a previous one is handled are not lost, and firmware that
+ * returns the last event again instead of 0 cannot have it handled more often
+ * than it notified. The workqueue is ordered, keeping events in order.
+ */
+#define S76_EVENT_DRAIN_MAX	16
+
+static struct workqueue_struct *s76_event_wq;
+
+// Notifications not yet drained
+static atomic_t s76_event_pending = ATOMIC_INIT(0);
+
+// Arrival of the oldest notification not yet drained, 0 if none
+static atomic64_t s76_event_stamp = ATOMIC64_INIT(0);
+
+static void s76_event_dispatch(u32 event, struct s76_event *ev)
+{
+	int ret;
+
+	pr_debug("WMI event code (%x)\n", event);
+
+	switch (event) {
+	case 0x7b:
+		//TODO: Fn+Backspace
+		return;
+	case 0x95:
+		//TODO: Fn+ESC
+		return;
+	case 0xFC:
+		// Touchpad WMI (disable)
+		return;
+	case 0xFD:
+		// Touchpad WMI (enable)
+		return;
+	}
+
+	ret = blocking_notifier_call_chain(&s76_event_chain, event, ev);
+	if (!(ret & NOTIFY_STOP_MASK))
+		pr_debug("Unknown WMI event code (%x)\n", event);
+}
+
+static void s76_event_work_fn(struct work_struct *work)
+{
+	struct s76_event ev;
+	u32 event;
+	int pending;
+	int i;
+
+	pending = atomic_xchg(&s76_event_pending, 0);
+	if (!pending)
+		return;
+
+	if (pending > S76_EVENT_DRAIN_MAX) {
+		pr_debug("%d WMI notifications, draining %d\n", pending,
+			 S76_EVENT_DRAIN_MAX);
+		pending = S76_EVENT_DRAIN_MAX;
+	}
+
+	// Events drained in one pass share the oldest notification time
+	ev.stamp = atomic64_xchg(&s76_event_stamp, 0);
+	if (!ev.stamp)
+		ev.stamp = ktime_get();
+
+	for (i = 0; i < pending; i++) {
+		if (s76_wmbb(GET_EVENT, 0, &event) || !event)
+			return;
+
+		s76_event_dispatch(event, &ev);
+	}
+}
+
+static DECLARE_WORK(s76_event_work, s76_event_work_fn);
+
+/*
+ * An event code written to debugfs is handed to the feature drivers as if
+ * the firmware had reported it, for tools/s76-stress.sh. Each writer
+ * dispatches it itself, so concurrent writers run the handlers concurrently.
+ */
+static ssize_t s76_inject_write(struct file *file, const char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	struct s76_event ev = { .stamp = ktime_get() };
+	u32 event;
+	int err;
+
+	err = kstrtou32_from_user(buf, count, 16, &event);
+	if (err)
+		return err;
+
+	s76_event_dispatch(event, &ev);
+
+	return count;
+}
+
+static const struct file_operations s76_inject_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.write = s76_inject_write,
+};
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 12, 0)
 static void s76_wmi_notify(union acpi_object *obj, void *context)
@@ -93,8 +442,6 @@ static void s76_wmi_notify(union acpi_object *obj, void *context)
 static void s76_wmi_notify(u32 value, void *context)
 #endif
 {
-	u32 event;
-
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 12, 0)
 	if (obj->type != ACPI_TYPE_INTEGER) {
 		pr_debug("Unexpected WMI event (%0#6x)\n", obj->type);
@@ -107,94 +454,243 @@ static void s76_wmi_notify(u32 value, void *context)
 	}
 #endif
 
-	s76_wmbb(GET_EVENT, 0, &event);
+	atomic64_cmpxchg(&s76_event_stamp, 0, ktime_get());
+	atomic_inc(&s76_event_pending);
+	queue_work(s76_event_wq, &s76_event_work);
+}
 
-	pr_debug("WMI event code (%x)\n", event);
+/*
+ * The firmware takes a while to answer again after resume. ACPI can accept a
+ * WMBB call before the EC behind it is back, so the firmware is ready once
+ * an EC read completes and the hotkey enable call, which resume has to issue
+ * anyway, returns its result. Both are polled with a growing interval until
+ * they succeed or the model's timeout expires.
+ */
+#define S76_READY_POLL_MIN_US	5000
+#define S76_READY_POLL_MAX_US	100000
 
-	switch (event) {
-	case 0x81:
-		if (driver_flags & (DRIVER_KB_LED_WMI | DRIVER_KB_LED))
-			kb_wmi_dec();
-		break;
-	case 0x82:
-		if (driver_flags & (DRIVER_KB_LED_WMI | DRIVER_KB_LED))
-			kb_wmi_inc();
-		break;
-	case 0x83:
-		if (driver_flags & (DRIVER_KB_LED_WMI | DRIVER_KB_LED))
-			kb_wmi_color();
-		break;
-	case 0x7b:
-		//TODO: Fn+Backspace
-		break;
-	case 0x95:
-		//TODO: Fn+ESC
-		break;
-	case 0x9F:
-		if (driver_flags & (DRIVER_KB_LED_WMI | DRIVER_KB_LED))
-			kb_wmi_toggle();
-		break;
-	case 0xD7:
-		if (driver_flags & DRIVER_OLED)
-			s76_input_screen_wmi();
-		break;
-	case 0x85:
-	case 0xF4:
-		if (driver_flags & DRIVER_AP_KEY)
-			s76_input_airplane_wmi();
-		break;
-	case 0xFC:
-		// Touchpad WMI (disable)
-		break;
-	case 0xFD:
-		// Touchpad WMI (enable)
-		break;
-	default:
-		pr_debug("Unknown WMI event code (%x)\n", event);
-		break;
+// Any register does, ec_read() times out while the EC is not answering
+#define S76_READY_EC_ADDR	0x00
+
+// Upper bounds of the wait histogram buckets, the last one takes the rest
+static const unsigned int s76_ready_hist_ms[] = {
+	10, 25, 50, 100, 250, 500, 1000, 2500, 5000,
+};
+
+static unsigned int s76_resume_wait_ms;
+static unsigned int s76_resume_wait_max_ms;
+static atomic_t s76_ready_hist[ARRAY_SIZE(s76_ready_hist_ms) + 1];
+
+static void s76_ready_hist_add(unsigned int wait_ms)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(s76_ready_hist_ms); i++) {
+		if (wait_ms <= s76_ready_hist_ms[i])
+			break;
 	}
+
+	atomic_inc(&s76_ready_hist[i]);
+}
+
+static int s76_ready_hist_show(struct seq_file *m, void *unused)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(s76_ready_hist_ms); i++)
+		seq_printf(m, "%u %d\n", s76_ready_hist_ms[i],
+			   atomic_read(&s76_ready_hist[i]));
+	seq_printf(m, "inf %d\n", atomic_read(&s76_ready_hist[i]));
+
+	return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(s76_ready_hist);
 
-static int __init s76_probe(struct platform_device *pdev)
+static int s76_check_ready(void)
 {
+	u32 result;
+	u8 val;
 	int err;
 
-	if (driver_flags & DRIVER_AP_LED) {
-		err = ap_led_init(&pdev->dev);
-		if (unlikely(err))
-			pr_warn("Could not register LED device\n");
-	}
+	err = ec_read(S76_READY_EC_ADDR, &val);
+	if (err)
+		return err;
+
+	// Enable hotkey support
+	return __s76_wmbb(0x46, 0, &result);
+}
+
+// Only resume waits are recorded, probe waits include the firmware's boot
+static int s76_poll_ready(bool resume)
+{
+	ktime_t start = ktime_get();
+	unsigned long timeout;
+	unsigned int delay_us = S76_READY_POLL_MIN_US;
+	unsigned int wait_ms;
+	int err;
+
+	timeout = jiffies + msecs_to_jiffies(s76_model->resume_timeout_ms);
+
+	for (;;) {
+		err = s76_check_ready();
+		if (!err || time_after(jiffies, timeout))
+			break;
 
-	if (driver_flags & (DRIVER_KB_LED_WMI | DRIVER_KB_LED)) {
-		err = kb_led_init(&pdev->dev);
-		if (unlikely(err))
-			pr_warn("Could not register LED device\n");
+		usleep_range(delay_us, delay_us * 2);
+		delay_us = min_t(unsigned int, delay_us * 2, S76_READY_POLL_MAX_US);
 	}
 
-	if (driver_flags & DRIVER_INPUT) {
-		err = s76_input_init(&pdev->dev);
-		if (unlikely(err))
-			pr_warn("Could not register input device\n");
+	wait_ms = ktime_ms_delta(ktime_get(), start);
+	if (resume) {
+		WRITE_ONCE(s76_resume_wait_ms, wait_ms);
+		if (wait_ms > s76_resume_wait_max_ms)
+			WRITE_ONCE(s76_resume_wait_max_ms, wait_ms);
+		s76_ready_hist_add(wait_ms);
 	}
 
-#if IS_ENABLED(CONFIG_HWMON)
-	if (driver_flags & DRIVER_HWMON)
-		s76_hwmon_init(&pdev->dev);
-#endif
+	if (err)
+		pr_warn("Firmware not ready after %u ms\n", wait_ms);
+	else
+		pr_debug("Firmware ready after %u ms\n", wait_ms);
+
+	return err;
+}
+
+/*
+ * Probe and resume only schedule the firmware setup. Feature drivers restore
+ * their state from their own work items once s76_ready completes, and the
+ * i8042 command does not involve the firmware and runs concurrently.
+ */
+static DECLARE_COMPLETION(s76_ready);
+
+// Whether s76_ready_work was queued by resume rather than probe
+static bool s76_ready_resume;
+
+// Time from module init to its return, probe continues asynchronously
+static u64 s76_load_us;
+
+void s76_wait_ready(void)
+{
+	wait_for_completion(&s76_ready);
+}
+EXPORT_SYMBOL_GPL(s76_wait_ready);
+
+static void s76_touchpad_lock(void)
+{
+	i8042_lock_chip();
+	i8042_command(NULL, 0x97);
+	i8042_unlock_chip();
+}
+
+static void s76_ready_work_fn(struct work_struct *work)
+{
+	ktime_t start = ktime_get();
+
+	s76_poll_ready(READ_ONCE(s76_ready_resume));
+	s76_stage("hotkey", start);
+	complete_all(&s76_ready);
+}
+
+static DECLARE_WORK(s76_ready_work, s76_ready_work_fn);
+
+static void s76_touchpad_work_fn(struct work_struct *work)
+{
+	ktime_t start = ktime_get();
+
+	// Enable touchpad lock
+	s76_touchpad_lock();
+	s76_stage("i8042", start);
+}
+
+static DECLARE_WORK(s76_touchpad_work, s76_touchpad_work_fn);
+
+static int s76_suspend(struct device *dev)
+{
+	pr_debug("suspend\n");
+
+	flush_work(&s76_ready_work);
+	flush_work(&s76_touchpad_work);
+	reinit_completion(&s76_ready);
+
+	return 0;
+}
+
+static int s76_resume(struct device *dev)
+{
+	pr_debug("resume\n");
+
+	s76_timeline_begin(&s76_timelines, "resume");
+
+	WRITE_ONCE(s76_ready_resume, true);
+	queue_work(system_unbound_wq, &s76_ready_work);
+	queue_work(system_unbound_wq, &s76_touchpad_work);
+
+	return 0;
+}
+
+static int s76_probe(struct platform_device *pdev)
+{
+	struct platform_device *feature;
+	ktime_t start;
+	int err;
+	int i;
 
+	s76_timeline_begin(&s76_timelines, "probe");
+
+	// The feature drivers may wait on it as soon as their devices exist
+	reinit_completion(&s76_ready);
+
+	s76_debugfs = debugfs_create_dir(S76_DRIVER_NAME, NULL);
+	debugfs_create_file("timelines", 0444, s76_debugfs, NULL,
+			    &s76_timelines_fops);
+	debugfs_create_file("latency", 0444, s76_debugfs, NULL,
+			    &s76_latencies_fops);
+	debugfs_create_file("ready", 0444, s76_debugfs, NULL,
+			    &s76_ready_hist_fops);
+	debugfs_create_u64("load_us", 0444, s76_debugfs, &s76_load_us);
+	debugfs_create_file("inject", 0200, s76_debugfs, NULL, &s76_inject_fops);
+
+	s76_event_wq = alloc_ordered_workqueue("system76-events",
+					       WQ_HIGHPRI | WQ_FREEZABLE);
+	if (!s76_event_wq) {
+		debugfs_remove_recursive(s76_debugfs);
+		return -ENOMEM;
+	}
+
+	start = ktime_get();
 	err = wmi_install_notify_handler(S76_EVENT_GUID, s76_wmi_notify, NULL);
 	if (unlikely(ACPI_FAILURE(err))) {
 		pr_err("Could not register WMI notify handler (%0#6x)\n", err);
+		destroy_workqueue(s76_event_wq);
+		debugfs_remove_recursive(s76_debugfs);
 		return -EIO;
 	}
+	s76_stage("wmi_handler", start);
 
-	// Enable hotkey support
-	s76_wmbb(0x46, 0, NULL);
+	start = ktime_get();
 
-	// Enable touchpad lock
-	i8042_lock_chip();
-	i8042_command(NULL, 0x97);
-	i8042_unlock_chip();
+	for (i = 0; i < ARRAY_SIZE(s76_features); i++) {
+		if (!s76_has(s76_features[i].flags))
+			continue;
+
+		feature = platform_device_register_data(&pdev->dev,
+							s76_features[i].name,
+							PLATFORM_DEVID_NONE,
+							&s76_model,
+							sizeof(s76_model));
+		if (IS_ERR(feature)) {
+			pr_warn("Could not register %s device\n", s76_features[i].name);
+			continue;
+		}
+
+		s76_feature_devices[i] = feature;
+	}
+	s76_stage("features", start);
+
+	// Enable hotkey support and touchpad lock off the probe path
+	WRITE_ONCE(s76_ready_resume, false);
+	queue_work(system_unbound_wq, &s76_ready_work);
+	queue_work(system_unbound_wq, &s76_touchpad_work);
 
 	return 0;
 }
@@ -205,57 +701,359 @@ static void s76_remove(struct platform_device *pdev)
 static int s76_remove(struct platform_device *pdev)
 #endif
 {
+	int i;
+
 	wmi_remove_notify_handler(S76_EVENT_GUID);
+	destroy_workqueue(s76_event_wq);
 
-#if IS_ENABLED(CONFIG_HWMON)
-	if (driver_flags & DRIVER_HWMON)
-		s76_hwmon_fini(&pdev->dev);
-#endif
+	cancel_work_sync(&s76_touchpad_work);
+	cancel_work_sync(&s76_ready_work);
+	complete_all(&s76_ready);
 
-	if (driver_flags & (DRIVER_KB_LED_WMI | DRIVER_KB_LED))
-		kb_led_exit();
+	for (i = ARRAY_SIZE(s76_feature_devices); i > 0; i--) {
+		platform_device_unregister(s76_feature_devices[i - 1]);
+		s76_feature_devices[i - 1] = NULL;
+	}
 
-	if (driver_flags & DRIVER_AP_LED)
-		ap_led_exit();
+	debugfs_remove_recursive(s76_debugfs);
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(6, 11, 0)
 	return 0;
 #endif
 }
 
-static int s76_suspend(struct device *dev)
+static ssize_t resume_wait_ms_show(struct device *dev,
+				   struct device_attribute *attr, char *buf)
 {
-	pr_debug("suspend\n");
+	return sysfs_emit(buf, "%u\n", READ_ONCE(s76_resume_wait_ms));
+}
+static DEVICE_ATTR_RO(resume_wait_ms);
 
-	if (driver_flags & (DRIVER_KB_LED_WMI | DRIVER_KB_LED))
-		kb_led_suspend();
+static ssize_t resume_wait_max_ms_show(struct device *dev,
+				       struct device_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%u\n", READ_ONCE(s76_resume_wait_max_ms));
+}
+static DEVICE_ATTR_RO(resume_wait_max_ms);
 
-	return 0;
+static struct attribute *s76_attrs[] = {
+	&dev_attr_resume_wait_ms.attr,
+	&dev_attr_resume_wait_max_ms.attr,
+	NULL
+};
+
+static const struct attribute_group s76_group = {
+	.attrs = s76_attrs,
+};
+
+/*
+ * Profiles are written to profiles/profile<n> as a name followed by
+ * settings, for example "quiet brightness=48 colors=FF0000 fans=auto":
+ *
+ *   brightness=<0-255>
+ *   colors=<rrggbb>[,<rrggbb>...]	one color, or one per zone
+ *   fans=auto|<0-255>[,<0-255>...]	one duty, or one per fan
+ *
+ * Writing an empty line clears the slot. Writing a name to profiles/active
+ * applies that profile.
+ */
+static DEFINE_MUTEX(s76_profile_mutex);
+// Protected by s76_profile_mutex
+static struct s76_profile s76_profiles[S76_PROFILES];
+static char s76_profile_active[S76_PROFILE_NAME_LEN];
+
+static bool s76_profile_has_kb(void)
+{
+	return s76_has(DRIVER_KB_LED_WMI | DRIVER_KB_LED);
 }
 
-static int s76_resume(struct device *dev)
+static bool s76_profile_has_fans(void)
 {
-	pr_debug("resume\n");
+	return IS_ENABLED(CONFIG_HWMON) && s76_has(DRIVER_HWMON);
+}
 
-	msleep(2000);
+// Parse a list of up to `max` values separated by commas, returns the count
+static int s76_profile_list(char *list, u32 *values, unsigned int max,
+			    unsigned int base, u32 limit)
+{
+	unsigned int n = 0;
+	char *tok;
+	int err;
 
-	if (driver_flags & DRIVER_AP_LED)
-		ap_led_resume();
+	while ((tok = strsep(&list, ","))) {
+		if (n == max)
+			return -EINVAL;
 
-	if (driver_flags & (DRIVER_KB_LED_WMI | DRIVER_KB_LED))
-		kb_led_resume();
+		err = kstrtou32(tok, base, &values[n]);
+		if (err)
+			return err;
 
-	// Enable hotkey support
-	s76_wmbb(0x46, 0, NULL);
+		if (values[n++] > limit)
+			return -EINVAL;
+	}
 
-	// Enable touchpad lock
-	i8042_lock_chip();
-	i8042_command(NULL, 0x97);
-	i8042_unlock_chip();
+	return n;
+}
 
-	return 0;
+static int s76_profile_parse_setting(struct s76_profile *profile, char *key,
+				     char *val)
+{
+	unsigned int zones = min_t(unsigned int, s76_model->nr_kb_zones, S76_ZONES_MAX);
+	unsigned int fans = min_t(unsigned int, s76_model->nr_fans, S76_PROFILE_FANS_MAX);
+	u32 duties[S76_PROFILE_FANS_MAX];
+	int i, n;
+
+	if (!strcmp(key, "brightness") && s76_profile_has_kb()) {
+		profile->set |= S76_PROFILE_KB_BRIGHTNESS;
+		return kstrtou8(val, 0, &profile->kb_brightness);
+	}
+
+	if (!strcmp(key, "colors") && s76_profile_has_kb()) {
+		n = s76_profile_list(val, profile->kb_colors, zones, 16, 0xFFFFFF);
+		if (n < 0)
+			return n;
+		if (n != 1 && n != zones)
+			return -EINVAL;
+
+		profile->set |= S76_PROFILE_KB_COLORS;
+		profile->nr_kb_colors = n;
+		return 0;
+	}
+
+	if (!strcmp(key, "fans") && s76_profile_has_fans() && fans) {
+		profile->set |= S76_PROFILE_FANS;
+		if (!strcmp(val, "auto"))
+			return 0;
+
+		n = s76_profile_list(val, duties, fans, 10, 255);
+		if (n < 0)
+			return n;
+		if (n != 1 && n != fans)
+			return -EINVAL;
+
+		profile->nr_fan_duties = n;
+		for (i = 0; i < n; i++)
+			profile->fan_duties[i] = duties[i];
+		return 0;
+	}
+
+	return -EINVAL;
+}
+
+static int s76_profile_parse(const char *buf, struct s76_profile *profile)
+{
+	char *copy, *p, *tok, *val;
+	int err = 0;
+
+	memset(profile, 0, sizeof(*profile));
+
+	copy = kstrdup(buf, GFP_KERNEL);
+	if (!copy)
+		return -ENOMEM;
+
+	p = strim(copy);
+	tok = strsep(&p, " \t");
+	if (strscpy(profile->name, tok, sizeof(profile->name)) < 0 ||
+	    strchr(profile->name, '='))
+		err = -EINVAL;
+
+	while (!err && (tok = strsep(&p, " \t"))) {
+		if (!*tok)
+			continue;
+
+		val = strchr(tok, '=');
+		if (!val) {
+			err = -EINVAL;
+			break;
+		}
+		*val++ = '\0';
+
+		err = s76_profile_parse_setting(profile, tok, val);
+	}
+
+	kfree(copy);
+
+	return err;
+}
+
+static ssize_t s76_profile_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct dev_ext_attribute *ea = container_of(attr, struct dev_ext_attribute, attr);
+	struct s76_profile *profile = &s76_profiles[(uintptr_t)ea->var];
+	unsigned int i;
+	int len;
+
+	mutex_lock(&s76_profile_mutex);
+
+	len = sysfs_emit(buf, "%s", profile->name);
+
+	if (profile->set & S76_PROFILE_KB_BRIGHTNESS)
+		len += sysfs_emit_at(buf, len, " brightness=%u", profile->kb_brightness);
+
+	if (profile->set & S76_PROFILE_KB_COLORS) {
+		for (i = 0; i < profile->nr_kb_colors; i++)
+			len += sysfs_emit_at(buf, len, "%s%06X", i ? "," : " colors=",
+					     profile->kb_colors[i]);
+	}
+
+	if (profile->set & S76_PROFILE_FANS) {
+		len += sysfs_emit_at(buf, len, " fans=");
+		if (!profile->nr_fan_duties)
+			len += sysfs_emit_at(buf, len, "auto");
+		for (i = 0; i < profile->nr_fan_duties; i++)
+			len += sysfs_emit_at(buf, len, "%s%u", i ? "," : "",
+					     profile->fan_duties[i]);
+	}
+
+	mutex_unlock(&s76_profile_mutex);
+
+	return len + sysfs_emit_at(buf, len, "\n");
+}
+
+static ssize_t s76_profile_store(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	struct dev_ext_attribute *ea = container_of(attr, struct dev_ext_attribute, attr);
+	struct s76_profile profile;
+	unsigned int i;
+	int err;
+
+	err = s76_profile_parse(buf, &profile);
+	if (err)
+		return err;
+
+	mutex_lock(&s76_profile_mutex);
+	for (i = 0; i < S76_PROFILES; i++) {
+		if (i != (uintptr_t)ea->var && profile.name[0] &&
+		    !strcmp(s76_profiles[i].name, profile.name)) {
+			err = -EEXIST;
+			break;
+		}
+	}
+	if (!err)
+		s76_profiles[(uintptr_t)ea->var] = profile;
+	mutex_unlock(&s76_profile_mutex);
+
+	return err ? err : count;
+}
+
+#define S76_PROFILE_ATTR(_n) \
+	static struct dev_ext_attribute dev_attr_profile##_n = { \
+		.attr = __ATTR(profile##_n, 0644, s76_profile_show, s76_profile_store), \
+		.var = (void *)_n, \
+	}
+
+S76_PROFILE_ATTR(0);
+S76_PROFILE_ATTR(1);
+S76_PROFILE_ATTR(2);
+S76_PROFILE_ATTR(3);
+
+static_assert(S76_PROFILES == 4);
+
+static ssize_t active_show(struct device *dev,
+			   struct device_attribute *attr, char *buf)
+{
+	ssize_t len;
+
+	mutex_lock(&s76_profile_mutex);
+	len = sysfs_emit(buf, "%s\n", s76_profile_active);
+	mutex_unlock(&s76_profile_mutex);
+
+	return len;
 }
 
+// Settings of the profile that no bound feature module handles
+static unsigned int s76_profile_unhandled(const struct s76_profile *profile,
+					  unsigned long action, int *err)
+{
+	struct s76_profile_ctx ctx = { .profile = profile };
+
+	*err = notifier_to_errno(blocking_notifier_call_chain(&s76_profile_chain,
+							      action, &ctx));
+
+	return profile->set & ~ctx.handled;
+}
+
+static int s76_profile_apply(const struct s76_profile *profile)
+{
+	unsigned int unhandled;
+	int err;
+
+	lockdep_assert_held(&s76_profile_mutex);
+
+	unhandled = s76_profile_unhandled(profile, S76_PROFILE_CHECK, &err);
+	if (err)
+		return err;
+
+	if (unhandled) {
+		pr_warn("profile %s: no driver for settings %#x\n", profile->name,
+			unhandled);
+		return -ENODEV;
+	}
+
+	pr_debug("activating profile %s\n", profile->name);
+
+	// A driver unbound since the check leaves its part unapplied too
+	unhandled = s76_profile_unhandled(profile, S76_PROFILE_APPLY, &err);
+	if (!err && unhandled)
+		err = -ENODEV;
+
+	// A firmware error leaves the remaining settings unapplied
+	strscpy(s76_profile_active, err ? "" : profile->name,
+		sizeof(s76_profile_active));
+
+	return err;
+}
+
+static ssize_t active_store(struct device *dev, struct device_attribute *attr,
+			    const char *buf, size_t count)
+{
+	struct s76_profile *profile = NULL;
+	unsigned int i;
+	int err;
+
+	mutex_lock(&s76_profile_mutex);
+
+	for (i = 0; i < S76_PROFILES; i++) {
+		if (s76_profiles[i].name[0] && sysfs_streq(buf, s76_profiles[i].name)) {
+			profile = &s76_profiles[i];
+			break;
+		}
+	}
+
+	if (profile)
+		err = s76_profile_apply(profile);
+	else
+		err = -ENOENT;
+
+	mutex_unlock(&s76_profile_mutex);
+
+	return err ? err : count;
+}
+static DEVICE_ATTR_RW(active);
+
+static struct attribute *s76_profile_attrs[] = {
+	&dev_attr_profile0.attr.attr,
+	&dev_attr_profile1.attr.attr,
+	&dev_attr_profile2.attr.attr,
+	&dev_attr_profile3.attr.attr,
+	&dev_attr_active.attr,
+	NULL
+};
+
+static const struct attribute_group s76_profile_group = {
+	.name = "profiles",
+	.attrs = s76_profile_attrs,
+};
+
+static const struct attribute_group *s76_groups[] = {
+	&s76_group,
+	&s76_profile_group,
+	NULL
+};
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 17, 0)
 static DEFINE_SIMPLE_DEV_PM_OPS(s76_pm, s76_suspend, s76_resume);
 #else
@@ -263,10 +1061,13 @@ static SIMPLE_DEV_PM_OPS(s76_pm, s76_suspend, s76_resume);
 #endif
 
 static struct platform_driver s76_platform_driver = {
+	.probe = s76_probe,
 	.remove = s76_remove,
 	.driver = {
 		.name  = S76_DRIVER_NAME,
 		.owner = THIS_MODULE,
+		.probe_type = PROBE_PREFER_ASYNCHRONOUS,
+		.dev_groups = s76_groups,
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 17, 0)
 		.pm = pm_sleep_ptr(&s76_pm),
 #else
@@ -278,7 +1079,7 @@ static struct platform_driver s76_platform_driver = {
 static int __init s76_dmi_matched(const struct dmi_system_id *id)
 {
 	pr_info("Model %s found\n", id->ident);
-	driver_flags = (uint64_t)id->driver_data;
+	s76_model = id->driver_data;
 	return 1;
 }
 
@@ -290,7 +1091,7 @@ static int __init s76_dmi_matched(const struct dmi_system_id *id)
 		DMI_MATCH(DMI_BIOS_VENDOR, "System76"), \
 	}, \
 	.callback = s76_dmi_matched, \
-	.driver_data = (void *)(uint64_t)0, \
+	.driver_data = NULL, \
 }
 
 #define DMI_TABLE(PRODUCT, DATA) { \
@@ -300,53 +1101,49 @@ static int __init s76_dmi_matched(const struct dmi_system_id *id)
 		DMI_MATCH(DMI_PRODUCT_VERSION, PRODUCT), \
 	}, \
 	.callback = s76_dmi_matched, \
-	.driver_data = (void *)(uint64_t)(DATA), \
+	.driver_data = (void *)(DATA), \
 }
 
+#define S76_MODEL_DMI(sym, product, data, ...) \
+	DMI_TABLE(product, S76_MODEL_ENABLED(sym) ? &s76_model_##sym : NULL),
+
 static struct dmi_system_id s76_dmi_table[] __initdata = {
 	DMI_TABLE_LEGACY("bonw13", DRIVER_HWMON | DRIVER_KB_LED_WMI),
-	DMI_TABLE("addw1", DRIVER_AP_LED | DRIVER_KB_LED_WMI | DRIVER_OLED),
-	DMI_TABLE("addw2", DRIVER_AP_LED | DRIVER_KB_LED_WMI | DRIVER_OLED),
-	DMI_TABLE("addw5", DRIVER_HWMON | DRIVER_KB_LED_WMI),
-	DMI_TABLE("bonw15-b", DRIVER_HWMON | DRIVER_KB_LED_WMI),
-	DMI_TABLE("bonw16", DRIVER_HWMON | DRIVER_KB_LED_WMI),
-	DMI_TABLE("darp5", DRIVER_AP_LED | DRIVER_HWMON | DRIVER_KB_LED_WMI),
-	DMI_TABLE("darp6", DRIVER_AP_LED | DRIVER_HWMON | DRIVER_KB_LED_WMI),
-	DMI_TABLE("galp2", DRIVER_HWMON),
-	DMI_TABLE("galp3", DRIVER_HWMON),
-	DMI_TABLE("galp3-b", DRIVER_AP_KEY | DRIVER_AP_LED | DRIVER_HWMON),
-	DMI_TABLE("galp3-c", DRIVER_AP_LED | DRIVER_HWMON),
-	DMI_TABLE("galp4", DRIVER_AP_LED | DRIVER_HWMON),
-	DMI_TABLE("gaze13", DRIVER_AP_KEY | DRIVER_AP_LED | DRIVER_HWMON),
-	DMI_TABLE("gaze14", DRIVER_AP_LED | DRIVER_KB_LED_WMI),
-	DMI_TABLE("gaze15", DRIVER_AP_LED | DRIVER_KB_LED_WMI),
-	DMI_TABLE("gaze20", DRIVER_AP_KEY | DRIVER_HWMON | DRIVER_KB_LED_WMI),
-	DMI_TABLE("kudu5", DRIVER_AP_KEY | DRIVER_AP_LED | DRIVER_HWMON),
-	DMI_TABLE("kudu6", DRIVER_AP_KEY | DRIVER_AP_WMI | DRIVER_KB_LED_WMI),
-	DMI_TABLE("oryp3-jeremy", DRIVER_AP_KEY | DRIVER_AP_LED | DRIVER_HWMON | DRIVER_KB_LED_WMI),
-	DMI_TABLE("oryp4", DRIVER_AP_KEY | DRIVER_AP_LED | DRIVER_HWMON | DRIVER_KB_LED_WMI),
-	DMI_TABLE("oryp4-b", DRIVER_AP_KEY | DRIVER_AP_LED | DRIVER_HWMON | DRIVER_KB_LED_WMI),
-	DMI_TABLE("oryp5", DRIVER_AP_LED | DRIVER_HWMON | DRIVER_KB_LED_WMI),
-	DMI_TABLE("oryp6", DRIVER_AP_LED | DRIVER_KB_LED_WMI),
-	DMI_TABLE("oryp13", DRIVER_AP_KEY | DRIVER_HWMON | DRIVER_KB_LED_WMI),
-	DMI_TABLE("pang10", DRIVER_AP_KEY | DRIVER_AP_WMI | DRIVER_KB_LED_WMI),
-	DMI_TABLE("pang11", DRIVER_AP_KEY | DRIVER_AP_WMI | DRIVER_KB_LED_WMI),
-	DMI_TABLE("serw11", DRIVER_AP_KEY | DRIVER_AP_LED | DRIVER_HWMON | DRIVER_KB_LED_WMI),
-	DMI_TABLE("serw11-b", DRIVER_AP_KEY | DRIVER_AP_LED | DRIVER_HWMON | DRIVER_KB_LED_WMI),
-	DMI_TABLE("serw12", DRIVER_AP_KEY | DRIVER_AP_LED | DRIVER_AP_WMI | DRIVER_KB_LED_WMI),
-	DMI_TABLE("serw14", DRIVER_HWMON | DRIVER_KB_LED),
+	S76_MODEL_LIST(S76_MODEL_DMI)
 	{}
 };
 MODULE_DEVICE_TABLE(dmi, s76_dmi_table);
 
+static const struct s76_model * __init s76_model_find(const char *name)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(s76_models); i++) {
+		if (s76_models[i] && sysfs_streq(s76_models[i]->name, name))
+			return s76_models[i];
+	}
+
+	return NULL;
+}
+
 static int __init s76_init(void)
 {
-	if (!dmi_check_system(s76_dmi_table)) {
+	ktime_t start = ktime_get();
+	int err;
+
+	if (param_model) {
+		s76_model = s76_model_find(param_model);
+		if (!s76_model) {
+			pr_err("Unknown model %s\n", param_model);
+			return -EINVAL;
+		}
+		pr_info("Model %s forced\n", s76_model->name);
+	} else if (!dmi_check_system(s76_dmi_table)) {
 		pr_info("Model does not utilize this driver\n");
 		return -ENODEV;
 	}
 
-	if (!driver_flags) {
+	if (!s76_model) {
 		pr_info("Driver data not defined\n");
 		return -ENODEV;
 	}
@@ -361,11 +1158,19 @@ static int __init s76_init(void)
 		return -ENODEV;
 	}
 
-	s76_platform_device =
-		platform_create_bundle(&s76_platform_driver, s76_probe, NULL, 0, NULL, 0);
+	err = platform_driver_register(&s76_platform_driver);
+	if (err)
+		return err;
 
-	if (IS_ERR(s76_platform_device))
+	s76_platform_device =
+		platform_device_register_simple(S76_DRIVER_NAME, PLATFORM_DEVID_NONE, NULL, 0);
+	if (IS_ERR(s76_platform_device)) {
+		platform_driver_unregister(&s76_platform_driver);
 		return PTR_ERR(s76_platform_device);
+	}
+
+	s76_load_us = ktime_us_delta(ktime_get(), start);
+	pr_debug("Module init returned after %llu us\n", s76_load_us);
 
 	return 0;
 }
@@ -0,0 +1,239 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * system76.h
+ *
+ * Interface between the system76 core and its feature modules
+ *
+ * Copyright (C) 2017 Jeremy Soller <jeremy@system76.com>
+ */
+
+#ifndef _SYSTEM76_H
+#define _SYSTEM76_H
+
+#include <linux/bits.h>
+#include <linux/build_bug.h>
+#include <linux/device.h>
+#include <linux/ktime.h>
+#include <linux/notifier.h>
+#include <linux/types.h>
+
+#include "latency.h"
+#include "zones.h"
+
+#define DRIVER_AP_KEY		BIT(0)
+#define DRIVER_AP_LED		BIT(1)
+#define DRIVER_HWMON		BIT(2)
+#define DRIVER_KB_LED_WMI	BIT(3)
+#define DRIVER_OLED		BIT(4)
+#define DRIVER_AP_WMI		BIT(5)
+#define DRIVER_KB_LED		BIT(6)
+
+#define DRIVER_INPUT  (DRIVER_AP_KEY | DRIVER_OLED)
+
+/*
+ * Supported models and the features they use
+ *
+ * Each entry expands to a `struct s76_model` descriptor in the core. Entries
+ * may append designated initializers to override the default layout. A
+ * model has no fans or temperature sensors unless its entry lists them, as
+ * those with DRIVER_HWMON do with S76_EC_SENSORS.
+ *
+ * Building with S76_MODELS="<model> ..." restricts the module to the listed
+ * models. Features that none of them use are then known to be absent at
+ * compile time and the code behind them is discarded.
+ */
+#define S76_EC_SENSORS \
+	.fans = s76_fans, .nr_fans = ARRAY_SIZE(s76_fans), \
+	.temps = s76_temps, .nr_temps = ARRAY_SIZE(s76_temps)
+
+#define S76_MODEL_LIST(M) \
+	M(addw1, "addw1", DRIVER_AP_LED | DRIVER_KB_LED_WMI | DRIVER_OLED) \
+	M(addw2, "addw2", DRIVER_AP_LED | DRIVER_KB_LED_WMI | DRIVER_OLED) \
+	M(addw5, "addw5", DRIVER_HWMON | DRIVER_KB_LED_WMI, S76_EC_SENSORS) \
+	M(bonw15_b, "bonw15-b", DRIVER_HWMON | DRIVER_KB_LED_WMI, S76_EC_SENSORS) \
+	M(bonw16, "bonw16", DRIVER_HWMON | DRIVER_KB_LED_WMI, S76_EC_SENSORS) \
+	M(darp5, "darp5", DRIVER_AP_LED | DRIVER_HWMON | DRIVER_KB_LED_WMI, S76_EC_SENSORS) \
+	M(darp6, "darp6", DRIVER_AP_LED | DRIVER_HWMON | DRIVER_KB_LED_WMI, S76_EC_SENSORS) \
+	M(galp2, "galp2", DRIVER_HWMON, S76_EC_SENSORS) \
+	M(galp3, "galp3", DRIVER_HWMON, S76_EC_SENSORS) \
+	M(galp3_b, "galp3-b", DRIVER_AP_KEY | DRIVER_AP_LED | DRIVER_HWMON, S76_EC_SENSORS) \
+	M(galp3_c, "galp3-c", DRIVER_AP_LED | DRIVER_HWMON, S76_EC_SENSORS) \
+	M(galp4, "galp4", DRIVER_AP_LED | DRIVER_HWMON, S76_EC_SENSORS) \
+	M(gaze13, "gaze13", DRIVER_AP_KEY | DRIVER_AP_LED | DRIVER_HWMON, S76_EC_SENSORS) \
+	M(gaze14, "gaze14", DRIVER_AP_LED | DRIVER_KB_LED_WMI) \
+	M(gaze15, "gaze15", DRIVER_AP_LED | DRIVER_KB_LED_WMI) \
+	M(gaze20, "gaze20", DRIVER_AP_KEY | DRIVER_HWMON | DRIVER_KB_LED_WMI, S76_EC_SENSORS) \
+	M(kudu5, "kudu5", DRIVER_AP_KEY | DRIVER_AP_LED | DRIVER_HWMON, S76_EC_SENSORS) \
+	M(kudu6, "kudu6", DRIVER_AP_KEY | DRIVER_AP_WMI | DRIVER_KB_LED_WMI) \
+	M(oryp3_jeremy, "oryp3-jeremy", DRIVER_AP_KEY | DRIVER_AP_LED | DRIVER_HWMON | DRIVER_KB_LED_WMI, S76_EC_SENSORS) \
+	M(oryp4, "oryp4", DRIVER_AP_KEY | DRIVER_AP_LED | DRIVER_HWMON | DRIVER_KB_LED_WMI, S76_EC_SENSORS) \
+	M(oryp4_b, "oryp4-b", DRIVER_AP_KEY | DRIVER_AP_LED | DRIVER_HWMON | DRIVER_KB_LED_WMI, S76_EC_SENSORS) \
+	M(oryp5, "oryp5", DRIVER_AP_LED | DRIVER_HWMON | DRIVER_KB_LED_WMI, S76_EC_SENSORS) \
+	M(oryp6, "oryp6", DRIVER_AP_LED | DRIVER_KB_LED_WMI) \
+	M(oryp13, "oryp13", DRIVER_AP_KEY | DRIVER_HWMON | DRIVER_KB_LED_WMI, S76_EC_SENSORS) \
+	M(pang10, "pang10", DRIVER_AP_KEY | DRIVER_AP_WMI | DRIVER_KB_LED_WMI) \
+	M(pang11, "pang11", DRIVER_AP_KEY | DRIVER_AP_WMI | DRIVER_KB_LED_WMI) \
+	M(serw11, "serw11", DRIVER_AP_KEY | DRIVER_AP_LED | DRIVER_HWMON | DRIVER_KB_LED_WMI, S76_EC_SENSORS) \
+	M(serw11_b, "serw11-b", DRIVER_AP_KEY | DRIVER_AP_LED | DRIVER_HWMON | DRIVER_KB_LED_WMI, S76_EC_SENSORS) \
+	M(serw12, "serw12", DRIVER_AP_KEY | DRIVER_AP_LED | DRIVER_AP_WMI | DRIVER_KB_LED_WMI) \
+	M(serw14, "serw14", DRIVER_HWMON | DRIVER_KB_LED, S76_EC_SENSORS, \
+	  .kb_zones = s76_zones_ecmd, .nr_kb_zones = ARRAY_SIZE(s76_zones_ecmd))
+
+#ifdef S76_MODELS_SELECTED
+#define S76_MODEL_ENABLED(sym)	IS_ENABLED(S76_MODEL_##sym)
+#else
+#define S76_MODEL_ENABLED(sym)	1
+#endif
+
+#define S76_MODEL_ANY(sym, product, data, ...)	| (S76_MODEL_ENABLED(sym) ? (u64)(data) : 0)
+#define S76_MODEL_ALL(sym, product, data, ...)	& (S76_MODEL_ENABLED(sym) ? (u64)(data) : ~0ULL)
+
+// Features used by at least one, and by every, model built in
+#define S76_FEATURES_ANY	(0ULL S76_MODEL_LIST(S76_MODEL_ANY))
+#define S76_FEATURES_ALL	(~0ULL S76_MODEL_LIST(S76_MODEL_ALL))
+
+static_assert(S76_FEATURES_ANY, "S76_MODELS does not name a supported model");
+
+struct s76_fan {
+	const char *label;
+	u8 rpm;		// Tachometer, high byte first
+	u8 duty;	// Current duty cycle
+};
+
+struct s76_temp {
+	const char *label;
+	u8 reg;
+};
+
+/*
+ * Per-model descriptor
+ *
+ * Subsystems only touch the firmware interfaces described here. Register
+ * addresses are EC RAM offsets.
+ */
+struct s76_model {
+	const char *name;
+	u64 features;
+
+	u8 ap_led;	// Airplane LED, BIT(6)
+	u8 ap_key;	// Airplane key latch, BIT(6)
+
+	const struct s76_fan *fans;
+	unsigned int nr_fans;
+
+	const struct s76_temp *temps;
+	unsigned int nr_temps;
+
+	const struct s76_zone *kb_zones;
+	unsigned int nr_kb_zones;
+
+	unsigned int resume_timeout_ms;	// Upper bound for firmware readiness
+};
+
+/*
+ * Every module keeps the descriptor of the matched model in its own
+ * `s76_model`. The core hands it to feature devices as platform data.
+ * The check is a compile-time constant whenever the selected models agree.
+ */
+#define s76_has(flags) \
+	((S76_FEATURES_ANY & (flags)) && \
+	 ((S76_FEATURES_ALL & (flags)) || (s76_model->features & (flags))))
+
+static inline const struct s76_model *s76_dev_model(struct device *dev)
+{
+	const struct s76_model * const *model = dev_get_platdata(dev);
+
+	return model ? *model : NULL;
+}
+
+// Feature devices created by the core, bound by the feature modules
+#define S76_AP_LED_NAME		"system76-ap-led"
+#define S76_INPUT_NAME		"system76-input"
+#define S76_KB_LED_NAME		"system76-kb-led"
+#define S76_HWMON_NAME		"system76-hwmon"
+
+int s76_wmbb(u32 method_id, u32 arg, u32 *retval);
+
+int s76_ec_read(u8 addr, u8 *val);
+int s76_ec_write(u8 addr, u8 val);
+int s76_ec_transaction(u8 command, const u8 *wdata, unsigned int wdata_len,
+		       u8 *rdata, unsigned int rdata_len);
+
+/*
+ * WMI events are dispatched to a blocking notifier chain with the event
+ * code as action and a struct s76_event as data. Each code belongs to one
+ * feature; its handler returns NOTIFY_STOP and every other handler
+ * NOTIFY_DONE.
+ */
+struct s76_event {
+	// When the firmware notification arrived
+	ktime_t stamp;
+};
+
+int s76_event_register(struct notifier_block *nb);
+void s76_event_unregister(struct notifier_block *nb);
+
+/*
+ * Profiles bundle keyboard lighting and fan settings. The core parses and
+ * validates them when they are written, then activation hands the profile
+ * to a blocking notifier chain twice. With S76_PROFILE_CHECK feature modules
+ * only report the settings they handle, so a profile with a part no bound
+ * module handles is rejected before anything changes. With
+ * S76_PROFILE_APPLY they apply their part in priority order, fans before
+ * keyboard, and skip values the firmware already holds. The fans go first
+ * as they are the part that is more likely to fail, and a failure stops the
+ * chain before the keyboard changed.
+ */
+#define S76_PROFILES		4
+#define S76_PROFILE_NAME_LEN	16
+#define S76_PROFILE_FANS_MAX	2
+
+#define S76_PROFILE_KB_BRIGHTNESS	BIT(0)
+#define S76_PROFILE_KB_COLORS		BIT(1)
+#define S76_PROFILE_FANS		BIT(2)
+
+#define S76_PROFILE_PRIO_FANS	1
+#define S76_PROFILE_PRIO_KB	0
+
+// Notifier actions
+#define S76_PROFILE_CHECK	0
+#define S76_PROFILE_APPLY	1
+
+struct s76_profile {
+	char name[S76_PROFILE_NAME_LEN];
+	unsigned int set;	// S76_PROFILE_* the profile sets
+
+	u8 kb_brightness;
+	// One color for every zone, or one per zone
+	unsigned int nr_kb_colors;
+	u32 kb_colors[S76_ZONES_MAX];
+
+	// No duties is automatic control, one duty applies to every fan
+	unsigned int nr_fan_duties;
+	u8 fan_duties[S76_PROFILE_FANS_MAX];
+};
+
+// Notifier data, modules add the S76_PROFILE_* settings they handle
+struct s76_profile_ctx {
+	const struct s76_profile *profile;
+	unsigned int handled;
+};
+
+int s76_profile_register(struct notifier_block *nb);
+void s76_profile_unregister(struct notifier_block *nb);
+
+// Latency series for the airplane key found by polling the EC
+#define S76_EVENT_EC_POLL	0x100
+
+void s76_latency(u32 event, enum s76_latency_stage stage, ktime_t stamp);
+
+/*
+ * Resume returns before the firmware answers again. Feature drivers restore
+ * their state from a work item that waits here first.
+ */
+void s76_wait_ready(void);
+
+// Record a probe or resume stage that began at `start` and ends now
+void s76_stage(const char *name, ktime_t start);
+
+#endif // _SYSTEM76_H
@@ -0,0 +1,104 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * timeline.h
+ *
+ * Per-stage timing of probe and resume. The last S76_TIMELINES runs are kept
+ * and printed through debugfs, one line per stage:
+ *
+ *   <timeline> <kind> <stage> <offset_us> <duration_us>
+ *
+ * The offset is relative to the start of the probe or resume callback.
+ * Stages may run concurrently from work items, so they can overlap.
+ */
+
+#ifndef _S76_TIMELINE_H
+#define _S76_TIMELINE_H
+
+#include <linux/ktime.h>
+#include <linux/seq_file.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/types.h>
+
+#define S76_TIMELINES		8
+#define S76_TIMELINE_STAGES	16
+#define S76_STAGE_NAME_LEN	16
+
+struct s76_stage {
+	// Copied, the caller may be a module that is unloaded later
+	char name[S76_STAGE_NAME_LEN];
+	s64 offset_us;
+	s64 duration_us;
+};
+
+struct s76_timeline {
+	const char *kind;
+	ktime_t start;
+	unsigned int nr_stages;
+	struct s76_stage stages[S76_TIMELINE_STAGES];
+};
+
+struct s76_timelines {
+	spinlock_t lock;
+	// Timelines started so far, the newest is entries[(count - 1) % S76_TIMELINES]
+	unsigned int count;
+	struct s76_timeline entries[S76_TIMELINES];
+};
+
+#define DEFINE_S76_TIMELINES(name) \
+	struct s76_timelines name = { .lock = __SPIN_LOCK_UNLOCKED(name.lock) }
+
+static inline void s76_timeline_begin(struct s76_timelines *t, const char *kind)
+{
+	struct s76_timeline *tl;
+
+	spin_lock(&t->lock);
+	tl = &t->entries[t->count++ % S76_TIMELINES];
+	tl->kind = kind;
+	tl->start = ktime_get();
+	tl->nr_stages = 0;
+	spin_unlock(&t->lock);
+}
+
+// Record a stage that began at `start` and ends now in the newest timeline
+static inline void s76_timeline_add(struct s76_timelines *t, const char *name,
+				    ktime_t start)
+{
+	ktime_t end = ktime_get();
+	struct s76_timeline *tl;
+	struct s76_stage *stage;
+
+	spin_lock(&t->lock);
+	if (t->count) {
+		tl = &t->entries[(t->count - 1) % S76_TIMELINES];
+		if (tl->nr_stages < S76_TIMELINE_STAGES) {
+			stage = &tl->stages[tl->nr_stages++];
+			strscpy(stage->name, name, sizeof(stage->name));
+			stage->offset_us = ktime_us_delta(start, tl->start);
+			stage->duration_us = ktime_us_delta(end, start);
+		}
+	}
+	spin_unlock(&t->lock);
+}
+
+static inline void s76_timeline_show(struct seq_file *m, struct s76_timelines *t)
+{
+	struct s76_timeline *tl;
+	struct s76_stage *stage;
+	unsigned int i, j;
+
+	spin_lock(&t->lock);
+	i = t->count > S76_TIMELINES ? t->count - S76_TIMELINES : 0;
+	for (; i != t->count; i++) {
+		tl = &t->entries[i % S76_TIMELINES];
+		for (j = 0; j < tl->nr_stages; j++) {
+			stage = &tl->stages[j];
+			seq_printf(m, "%u %s %s %lld %lld\n", i, tl->kind,
+				   stage->name, stage->offset_us,
+				   stage->duration_us);
+		}
+	}
+	spin_unlock(&t->lock);
+}
+
+#endif // _S76_TIMELINE_H
@@ -0,0 +1,56 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * zones.h
+ *
+ * Keyboard lighting zones. A zone is set through the SET_KB_LED command in
+ * WMBB, or through subcommand 0xCA of the EC's ECMD method. Each entry
+ * holds the opcode of the interface that reaches the zone.
+ *
+ * The tables are defined by the file that includes this header with
+ * S76_ZONES_DEFINE set, once per module that uses them.
+ */
+
+#ifndef _S76_ZONES_H
+#define _S76_ZONES_H
+
+#include <linux/bits.h>
+#include <linux/types.h>
+
+// Upper bound of zones per keyboard, sizes the per-zone state and bitmaps
+#define S76_ZONES_MAX	16
+
+// Zone capabilities
+#define S76_ZONE_COLOR		BIT(0)	// Takes an RGB color
+#define S76_ZONE_FW_EFFECT	BIT(1)	// Animated by the firmware lighting modes
+
+struct s76_zone {
+	const char *name;	// Suffix of the color_<name> attribute
+	u32 wmi;		// SET_KB_LED command, color in the low 24 bits
+	u8 ecmd;		// ECMD 0xCA target
+	u8 caps;		// S76_ZONE_*
+};
+
+#define S76_ZONES_WMI	4
+#define S76_ZONES_ECMD	5
+
+extern const struct s76_zone s76_zones_wmi[S76_ZONES_WMI];
+extern const struct s76_zone s76_zones_ecmd[S76_ZONES_ECMD];
+
+#ifdef S76_ZONES_DEFINE
+const struct s76_zone s76_zones_wmi[S76_ZONES_WMI] = {
+	{ .name = "left", .wmi = 0xF0000000, .caps = S76_ZONE_COLOR | S76_ZONE_FW_EFFECT },
+	{ .name = "center", .wmi = 0xF1000000, .caps = S76_ZONE_COLOR | S76_ZONE_FW_EFFECT },
+	{ .name = "right", .wmi = 0xF2000000, .caps = S76_ZONE_COLOR | S76_ZONE_FW_EFFECT },
+	{ .name = "extra", .wmi = 0xF3000000, .caps = S76_ZONE_COLOR | S76_ZONE_FW_EFFECT },
+};
+
+const struct s76_zone s76_zones_ecmd[S76_ZONES_ECMD] = {
+	{ .name = "left", .ecmd = 0x03, .caps = S76_ZONE_COLOR },
+	{ .name = "center", .ecmd = 0x04, .caps = S76_ZONE_COLOR },
+	{ .name = "right", .ecmd = 0x05, .caps = S76_ZONE_COLOR },
+	{ .name = "extra", .ecmd = 0x0B, .caps = S76_ZONE_COLOR },	// Numpad
+	{ .name = "lightbar", .ecmd = 0x07, .caps = S76_ZONE_COLOR },
+};
+#endif
+
+#endif // _S76_ZONES_H
@@ -0,0 +1,220 @@
+#!/bin/sh
+# SPDX-License-Identifier: GPL-2.0-or-later
+#
+# Stress the LED and fan attributes and the hotkey handlers concurrently.
+#
+# Usage: sudo tools/s76-stress.sh [seconds] [jobs]
+#
+# Runs twice, first with one reader, writer and event injector per
+# attribute, then with `jobs` of each, for `seconds` each. Readers check that
+# each value is well formed, so a torn read shows up as a failure. Keyboard
+# hotkey events are injected through debugfs and run the same handlers as
+# firmware events. Each run prints reads, writes and events per second, so
+# the second run shows how readers scale while writers hold the locks.
+#
+# The kernel log is checked for lockdep, hung task, WARN and BUG reports
+# afterwards. Fans are put back under automatic control.
+
+set -u
+
+SECONDS_RUN=${1:-30}
+JOBS=${2:-4}
+
+KB=/sys/class/leds/system76::kbd_backlight
+AP=/sys/class/leds/system76::airplane
+INJECT=/sys/kernel/debug/system76/inject
+HWMON=
+for dir in /sys/class/hwmon/hwmon*; do
+	if [ "$(cat "$dir/name" 2>/dev/null)" = system76 ]; then
+		HWMON=$dir
+	fi
+done
+
+# Keyboard backlight hotkeys only, the others would reach userspace
+EVENTS="81 82 83 9F"
+
+# Lowest duty written to the fans, so they keep spinning
+PWM_MIN=100
+
+# Iterations between deadline checks, date forks
+CHECK_EVERY=64
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+fail() {
+	echo "FAIL: $*" | tee -a "$TMP/failed"
+}
+
+# Pseudo-random number below $1 without forking, seeded per job
+rand() {
+	seed=$(( (seed * 1103515245 + 12345) % 2147483648 ))
+	r=$(( seed / 65536 % $1 ))
+}
+
+# Whether $1 is a value of kind $2
+valid() {
+	case $2 in
+	num)
+		case $1 in
+		''|*[!0-9]*) return 1 ;;
+		esac
+		;;
+	colors)
+		[ -n "$1" ] || return 1
+		for c in $1; do
+			valid "$c" color || return 1
+		done
+		;;
+	color)
+		case $1 in
+		[0-9A-F][0-9A-F][0-9A-F][0-9A-F][0-9A-F][0-9A-F]) ;;
+		*) return 1 ;;
+		esac
+		;;
+	esac
+}
+
+gen() {
+	case $1 in
+	num)
+		rand 256
+		v=$r
+		;;
+	color|colors)
+		rand 256
+		red=$r
+		rand 256
+		green=$r
+		rand 256
+		v=$(printf '%02X%02X%02X' "$red" "$green" "$r")
+		;;
+	pwm)
+		rand $((256 - PWM_MIN))
+		v=$((PWM_MIN + r))
+		;;
+	pwm_enable)
+		rand 3
+		v=$r
+		;;
+	event)
+		rand 4
+		set -- $EVENTS
+		shift "$r"
+		v=$1
+		;;
+	esac
+}
+
+# loop <read|write> <attribute> <kind> <counter file>
+loop() {
+	seed=$(( $$ + $(date +%N | sed 's/^0*//') + 1 ))
+	end=$(( $(date +%s) + SECONDS_RUN ))
+	n=0
+
+	while :; do
+		if [ $((n % CHECK_EVERY)) -eq 0 ] && [ "$(date +%s)" -ge "$end" ]; then
+			break
+		fi
+
+		if [ "$1" = read ]; then
+			read -r value < "$2" 2>/dev/null || continue
+			if ! valid "$value" "$3"; then
+				fail "$2 read '$value'"
+				break
+			fi
+		else
+			gen "$3"
+			echo "$v" > "$2" 2>/dev/null
+		fi
+		n=$((n + 1))
+	done
+
+	echo "$n" > "$4"
+}
+
+# stress <jobs> <attribute> <kind> [read]
+stress() {
+	[ -w "$2" ] || return 0
+
+	i=0
+	while [ "$i" -lt "$1" ]; do
+		jobid=$((jobid + 1))
+		loop write "$2" "$3" "$TMP/write.$jobid" &
+		if [ -n "${4:-}" ]; then
+			loop read "$2" "$3" "$TMP/read.$jobid" &
+		fi
+		i=$((i + 1))
+	done
+}
+
+sum() {
+	cat "$TMP"/"$1".* 2>/dev/null | awk '{ s += $1 } END { print s + 0 }'
+}
+
+# run <jobs>
+run() {
+	rm -f "$TMP"/read.* "$TMP"/write.* "$TMP"/event.*
+	jobid=0
+
+	if [ -d "$KB" ]; then
+		stress "$1" "$KB/brightness" num read
+		for attr in "$KB"/color_*; do
+			stress "$1" "$attr" color read
+		done
+		stress "$1" "$KB/colors" colors read
+	fi
+
+	if [ -d "$AP" ]; then
+		stress "$1" "$AP/brightness" num read
+	fi
+
+	if [ -n "$HWMON" ]; then
+		for attr in "$HWMON"/pwm[0-9]; do
+			stress "$1" "$attr" pwm read
+			stress "$1" "${attr}_enable" pwm_enable read
+		done
+	fi
+
+	if [ -w "$INJECT" ]; then
+		i=0
+		while [ "$i" -lt "$1" ]; do
+			jobid=$((jobid + 1))
+			loop write "$INJECT" event "$TMP/event.$jobid" &
+			i=$((i + 1))
+		done
+	fi
+
+	wait
+
+	echo "$1 jobs per attribute:" \
+	     "$(( $(sum read) / SECONDS_RUN )) reads/s," \
+	     "$(( $(sum write) / SECONDS_RUN )) writes/s," \
+	     "$(( $(sum event) / SECONDS_RUN )) events/s"
+}
+
+if [ ! -w "$INJECT" ]; then
+	echo "$INJECT not available, no events are injected"
+fi
+
+dmesg_before=$(dmesg | wc -l)
+
+run 1
+run "$JOBS"
+
+if [ -n "$HWMON" ]; then
+	for attr in "$HWMON"/pwm[0-9]_enable; do
+		echo 2 > "$attr"
+	done
+fi
+
+if dmesg | tail -n +"$((dmesg_before + 1))" |
+	grep -E 'possible (recursive|circular) locking|inconsistent lock state|blocked for more than|WARNING:|BUG:'; then
+	fail "kernel log reports the above"
+fi
+
+if [ -s "$TMP/failed" ]; then
+	exit 1
+fi
+
+echo "PASS"